@@ -0,0 +1,483 @@
+/* Allocator micro-benchmarks.
+ *
+ * Runs a set of standard workloads against the pool, in each allocation mode,
+ * and against the C library malloc() as a baseline. Every workload reports
+ * its throughput and the p50/p99/p999 latency of each kind of operation.
+ *
+ * Usage: bench.out [-n ops] [-t threads] [-w workload]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpool.h"
+
+#define ARENA_SIZE (64 << 20)
+#define NR_SLOTS 4096
+
+/* The operations every allocator under test provides */
+struct allocator {
+    const char *name;
+    int flags; /**< pool mode, -1 for the C library */
+    pool_t pool;
+    void *arena;
+};
+
+static void *bench_malloc(struct allocator *a, int size)
+{
+    return a->flags < 0 ? malloc(size) : pool_malloc_ex(&a->pool, size);
+}
+
+static void *bench_realloc(struct allocator *a, void *ptr, int size)
+{
+    return a->flags < 0 ? realloc(ptr, size)
+                        : pool_realloc_ex(&a->pool, ptr, size);
+}
+
+static void bench_free(struct allocator *a, void *ptr)
+{
+    if (a->flags < 0)
+        free(ptr);
+    else
+        pool_free_ex(&a->pool, ptr);
+}
+
+static int allocator_setup(struct allocator *a)
+{
+    if (a->flags < 0)
+        return 0;
+
+    a->arena = malloc(ARENA_SIZE);
+    if (!a->arena || !pool_init_ex(&a->pool, a->arena, ARENA_SIZE, a->flags))
+        return -1;
+    return 0;
+}
+
+static void allocator_teardown(struct allocator *a)
+{
+    if (a->flags < 0)
+        return;
+
+    pool_destroy_ex(&a->pool);
+    free(a->arena);
+}
+
+/* Latency samples of one kind of operation, in nanoseconds */
+struct samples {
+    uint32_t *ns;
+    long count, capacity;
+};
+
+enum { OP_MALLOC, OP_FREE, OP_REALLOC, NR_OPS };
+static const char *op_names[NR_OPS] = {"malloc", "free", "realloc"};
+
+struct stats {
+    struct samples op[NR_OPS];
+    long failures;
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(struct stats *st, int op, uint64_t start)
+{
+    uint64_t ns = now_ns() - start;
+    struct samples *s = &st->op[op];
+
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 1 << 16;
+        s->ns = realloc(s->ns, s->capacity * sizeof(*s->ns));
+        if (!s->ns) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->ns[s->count++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static void stats_merge(struct stats *to, struct stats *from)
+{
+    for (int op = 0; op < NR_OPS; op++) {
+        struct samples *s = &from->op[op];
+        struct samples *d = &to->op[op];
+        d->ns = realloc(d->ns, (d->count + s->count) * sizeof(*d->ns));
+        if (s->count && !d->ns) {
+            perror("realloc");
+            exit(1);
+        }
+        memcpy(d->ns + d->count, s->ns, s->count * sizeof(*s->ns));
+        d->count += s->count;
+        d->capacity = d->count;
+        free(s->ns);
+        s->ns = NULL;
+        s->count = s->capacity = 0;
+    }
+    to->failures += from->failures;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(struct samples *s, double p)
+{
+    long i = (long) (p * (s->count - 1));
+    return s->ns[i];
+}
+
+static void report(const char *workload,
+                   struct allocator *a,
+                   struct stats *st,
+                   uint64_t elapsed)
+{
+    long total = 0;
+    for (int op = 0; op < NR_OPS; op++)
+        total += st->op[op].count;
+
+    printf("%-14s %-12s %12.0f ops/s", workload, a->name,
+           elapsed ? total * 1e9 / elapsed : 0.0);
+    for (int op = 0; op < NR_OPS; op++) {
+        struct samples *s = &st->op[op];
+        if (!s->count)
+            continue;
+        qsort(s->ns, s->count, sizeof(*s->ns), cmp_u32);
+        printf("  %s p50/p99/p999 %u/%u/%u ns", op_names[op],
+               percentile(s, 0.50), percentile(s, 0.99),
+               percentile(s, 0.999));
+    }
+    if (st->failures)
+        printf("  (%ld failed)", st->failures);
+    printf("\n");
+
+    for (int op = 0; op < NR_OPS; op++)
+        free(st->op[op].ns);
+    memset(st, 0, sizeof(*st));
+}
+
+/* Small xorshift generator, each thread keeps its own state */
+static inline uint32_t rnd(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static inline void *timed_malloc(struct allocator *a,
+                                 struct stats *st,
+                                 int size)
+{
+    uint64_t start = now_ns();
+    void *ptr = bench_malloc(a, size);
+    record(st, OP_MALLOC, start);
+    if (!ptr)
+        st->failures++;
+    return ptr;
+}
+
+static inline void timed_free(struct allocator *a, struct stats *st, void *ptr)
+{
+    uint64_t start = now_ns();
+    bench_free(a, ptr);
+    record(st, OP_FREE, start);
+}
+
+/* Allocates a batch of same-size blocks, then releases them in order */
+static void wl_sequential(struct allocator *a, struct stats *st, long ops)
+{
+    static void *slots[NR_SLOTS];
+
+    for (long done = 0; done < ops; done += 2 * NR_SLOTS) {
+        for (int i = 0; i < NR_SLOTS; i++)
+            slots[i] = timed_malloc(a, st, 64);
+        for (int i = 0; i < NR_SLOTS; i++)
+            timed_free(a, st, slots[i]);
+    }
+}
+
+/* Random sizes, allocated and released in random order */
+static void wl_random(struct allocator *a, struct stats *st, long ops)
+{
+    static void *slots[NR_SLOTS];
+    uint32_t seed = 42;
+
+    for (long done = 0; done < ops; done++) {
+        int i = rnd(&seed) % NR_SLOTS;
+        if (slots[i]) {
+            timed_free(a, st, slots[i]);
+            slots[i] = NULL;
+        } else {
+            /* mostly small blocks, sometimes a few KiB */
+            int size = rnd(&seed) % 8 ? 8 + rnd(&seed) % 248
+                                       : 256 + rnd(&seed) % 8192;
+            slots[i] = timed_malloc(a, st, size);
+        }
+    }
+    for (int i = 0; i < NR_SLOTS; i++) {
+        bench_free(a, slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+/* Buffers grown step by step, as done when building messages */
+static void wl_realloc(struct allocator *a, struct stats *st, long ops)
+{
+    enum { nr_buffers = 64, max_size = 64 << 10 };
+    void *buffers[nr_buffers] = {0};
+    int sizes[nr_buffers] = {0};
+    uint32_t seed = 7;
+
+    for (long done = 0; done < ops; done++) {
+        int i = rnd(&seed) % nr_buffers;
+        if (sizes[i] >= max_size) {
+            timed_free(a, st, buffers[i]);
+            buffers[i] = NULL;
+            sizes[i] = 0;
+            continue;
+        }
+
+        int size = sizes[i] + 16 + rnd(&seed) % 512;
+        uint64_t start = now_ns();
+        void *ptr = bench_realloc(a, buffers[i], size);
+        record(st, OP_REALLOC, start);
+        if (!ptr) {
+            st->failures++;
+            continue;
+        }
+        buffers[i] = ptr;
+        sizes[i] = size;
+    }
+    for (int i = 0; i < nr_buffers; i++)
+        bench_free(a, buffers[i]);
+}
+
+/* Fills the arena with small blocks, releases every other one, then asks for
+ * larger blocks which the holes can not hold.
+ */
+static void wl_churn(struct allocator *a, struct stats *st, long ops)
+{
+    static void *slots[NR_SLOTS];
+    uint32_t seed = 3;
+
+    for (long done = 0; done < ops;) {
+        for (int i = 0; i < NR_SLOTS; i++, done++)
+            slots[i] = timed_malloc(a, st, 16 + rnd(&seed) % 112);
+        for (int i = 0; i < NR_SLOTS; i += 2, done++) {
+            timed_free(a, st, slots[i]);
+            slots[i] = timed_malloc(a, st, 256 + rnd(&seed) % 768);
+            done++;
+        }
+        for (int i = 0; i < NR_SLOTS; i++, done++)
+            timed_free(a, st, slots[i]);
+    }
+}
+
+/* Leaves 16k holes of 64 bytes between live blocks, then asks for blocks
+ * none of them can hold, so each search goes through all the free space.
+ */
+static void wl_holes(struct allocator *a, struct stats *st, long ops)
+{
+    enum { nr_holes = 16384 };
+    static void *slots[2 * nr_holes];
+    long done = 0;
+
+    for (int i = 0; i < 2 * nr_holes; i++, done++)
+        slots[i] = timed_malloc(a, st, 64);
+    for (int i = 0; i < 2 * nr_holes; i += 2, done++)
+        timed_free(a, st, slots[i]);
+    for (; done < ops; done += 2)
+        timed_free(a, st, timed_malloc(a, st, 256));
+    for (int i = 1; i < 2 * nr_holes; i += 2)
+        bench_free(a, slots[i]);
+}
+
+/* Producer/consumer: blocks allocated by one thread, released by another */
+struct ring {
+    void *slots[1024];
+    unsigned long head, tail; /**< written by producer/consumer only */
+};
+
+struct pc_args {
+    struct allocator *a;
+    struct ring *ring;
+    struct stats st;
+    long ops;
+};
+
+static void *pc_consumer(void *ptr)
+{
+    struct pc_args *args = ptr;
+    struct ring *r = args->ring;
+
+    for (long done = 0; done < args->ops; done++) {
+        unsigned long tail = r->tail;
+        while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+            sched_yield();
+        void *block = r->slots[tail % 1024];
+        __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+        timed_free(args->a, &args->st, block);
+    }
+    return NULL;
+}
+
+static void wl_prodcons(struct allocator *a, struct stats *st, long ops)
+{
+    static struct ring ring;
+    struct pc_args args = {.a = a, .ring = &ring, .ops = ops / 2};
+    pthread_t consumer;
+    uint32_t seed = 11;
+
+    ring.head = ring.tail = 0;
+    pthread_create(&consumer, NULL, pc_consumer, &args);
+    for (long done = 0; done < ops / 2; done++) {
+        unsigned long head = ring.head;
+        while (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == 1024)
+            sched_yield();
+        void *block;
+        while (!(block = timed_malloc(a, st, 16 + rnd(&seed) % 240)))
+            sched_yield(); /* wait for the consumer to give memory back */
+        ring.slots[head % 1024] = block;
+        __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(consumer, NULL);
+    stats_merge(st, &args.st);
+}
+
+/* Random workload run by several threads at once */
+struct mt_args {
+    struct allocator *a;
+    struct stats st;
+    long ops;
+    uint32_t seed;
+};
+
+static void *mt_worker(void *ptr)
+{
+    struct mt_args *args = ptr;
+    void *slots[256] = {0};
+
+    for (long done = 0; done < args->ops; done++) {
+        int i = rnd(&args->seed) % 256;
+        if (slots[i]) {
+            timed_free(args->a, &args->st, slots[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = timed_malloc(args->a, &args->st,
+                                    8 + rnd(&args->seed) % 248);
+        }
+    }
+    for (int i = 0; i < 256; i++)
+        bench_free(args->a, slots[i]);
+    return NULL;
+}
+
+static int nr_threads = 4;
+
+static void wl_threads(struct allocator *a, struct stats *st, long ops)
+{
+    pthread_t threads[nr_threads];
+    struct mt_args args[nr_threads];
+
+    for (int t = 0; t < nr_threads; t++) {
+        args[t] = (struct mt_args){.a = a, .ops = ops / nr_threads,
+                                   .seed = 1 + t};
+        pthread_create(&threads[t], NULL, mt_worker, &args[t]);
+    }
+    for (int t = 0; t < nr_threads; t++) {
+        pthread_join(threads[t], NULL);
+        stats_merge(st, &args[t].st);
+    }
+}
+
+struct workload {
+    const char *name;
+    void (*run)(struct allocator *a, struct stats *st, long ops);
+    bool threaded; /**< needs a thread-safe allocator */
+};
+
+static const struct workload workloads[] = {
+    {"sequential", wl_sequential, false},
+    {"random", wl_random, false},
+    {"prodcons", wl_prodcons, true},
+    {"realloc", wl_realloc, false},
+    {"churn", wl_churn, false},
+    {"holes", wl_holes, false},
+    {"threads", wl_threads, true},
+};
+
+static struct allocator allocators[] = {
+    {.name = "first-fit", .flags = POOL_FIRST_FIT},
+    {.name = "best-fit", .flags = POOL_BEST_FIT},
+    {.name = "packed", .flags = POOL_PACKED},
+    {.name = "packed-best", .flags = POOL_PACKED | POOL_BEST_FIT},
+    {.name = "binned", .flags = POOL_BINNED},
+    {.name = "quick", .flags = POOL_BINNED | POOL_QUICK},
+    {.name = "thread-safe", .flags = POOL_BINNED | POOL_THREAD_SAFE},
+    {.name = "glibc", .flags = -1},
+};
+
+int main(int argc, char *argv[])
+{
+    long ops = 1000000;
+    const char *only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:w:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n ops] [-t threads] [-w workload]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (ops <= 0 || nr_threads <= 0) {
+        fprintf(stderr, "invalid number of operations or threads\n");
+        return 1;
+    }
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(*workloads); w++) {
+        const struct workload *wl = &workloads[w];
+        if (only && strcmp(only, wl->name))
+            continue;
+
+        for (size_t i = 0; i < sizeof(allocators) / sizeof(*allocators); i++) {
+            struct allocator *a = &allocators[i];
+            if (wl->threaded && a->flags >= 0 &&
+                !(a->flags & POOL_THREAD_SAFE))
+                continue;
+            if (allocator_setup(a)) {
+                fprintf(stderr, "%s: can not set up the arena\n", a->name);
+                return 1;
+            }
+
+            struct stats st = {0};
+            uint64_t start = now_ns();
+            wl->run(a, &st, ops);
+            uint64_t elapsed = now_ns() - start;
+            report(wl->name, a, &st, elapsed);
+            allocator_teardown(a);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mpool.h"
+
+/* A bump region is a chain of chunks of the arena, the newest first. Objects
+ * are laid out one after the other in the newest chunk, from @top up to @end,
+ * without any header nor free list:
+ *
+ * ┌──────┬─────┬─────┬─────┐   ┌──────┬─────┬─────┬────────────┐
+ * │ bump │ Obj │ Obj │ Obj │◀──┼─prev │ Obj │ Obj │ ~~ room ~~ │
+ * └──────┴─────┴─────┴─────┘   └──────┴─────┴─────┴────────────┘
+ *   first chunk                  newest chunk      ▲ top       ▲ end
+ *
+ * Once the newest chunk is full, a new one is taken from the pool, so the
+ * region only fails if the pool does. Going back to a mark gives back the
+ * chunks taken since then; the first one is kept until the region is
+ * destroyed. A reset rather keeps them all, the chain moved as a whole to
+ * the spare chunks, which the region grows into again before taking new
+ * ones from the pool.
+ */
+struct bump_chunk {
+    struct bump_chunk *prev; /**< chunk filled before, NULL for the first */
+    char *end;               /**< end of the chunk */
+};
+
+struct pool_bump {
+    pool_t *pool;              /**< pool owning the chunks, NULL for default */
+    struct bump_chunk *chunk;  /**< chunk being filled */
+    char *top;                 /**< first free byte of @chunk */
+    char *end;                 /**< end of @chunk */
+    size_t chunk_size;         /**< room of a new chunk */
+    struct bump_chunk *bottom; /**< chunk chained right after @first */
+    struct bump_chunk *spare;  /**< chunks kept by a reset, linked by prev */
+    struct bump_chunk first;   /**< chunk holding this header */
+};
+
+enum {
+    bump_header = (sizeof(pool_bump_t) + sizeof(void *) - 1) &
+                  ~(sizeof(void *) - 1),
+    chunk_header = (sizeof(struct bump_chunk) + sizeof(void *) - 1) &
+                   ~(sizeof(void *) - 1),
+};
+
+static inline void *bump_malloc(pool_t *pool, size_t size)
+{
+    return pool ? pool_malloc_ex(pool, size) : pool_malloc(size);
+}
+
+static inline void bump_free(pool_t *pool, void *ptr)
+{
+    if (pool)
+        pool_free_ex(pool, ptr);
+    else
+        pool_free(ptr);
+}
+
+static pool_bump_t *bump_setup(pool_bump_t *bump, pool_t *pool, size_t size)
+{
+    if (!bump)
+        return NULL;
+
+    bump->pool = pool;
+    bump->chunk = &bump->first;
+    bump->top = (char *) bump + bump_header;
+    bump->end = bump->top + size;
+    bump->chunk_size = size;
+    bump->bottom = NULL;
+    bump->spare = NULL;
+    bump->first.prev = NULL;
+    bump->first.end = bump->end;
+    return bump;
+}
+
+pool_bump_t *pool_bump_create_ex(pool_t *pool, size_t size)
+{
+    if (!size || size > PTRDIFF_MAX - bump_header)
+        return NULL;
+
+    return bump_setup(pool_malloc_ex(pool, bump_header + size), pool, size);
+}
+
+pool_bump_t *pool_bump_create(size_t size)
+{
+    if (!size || size > PTRDIFF_MAX - bump_header)
+        return NULL;
+
+    return bump_setup(pool_malloc(bump_header + size), NULL, size);
+}
+
+/* Chains a new chunk with room for @size bytes at least.
+ * Returns:
+ *   true on success, otherwise false if the pool is out of memory
+ */
+static bool bump_grow(pool_bump_t *bump, size_t size)
+{
+    if (size < bump->chunk_size)
+        size = bump->chunk_size;
+    if (size > PTRDIFF_MAX - chunk_header)
+        return false;
+
+    /* the first spare chunk is reused, or given back if too small, so the
+     * spare chunks never outnumber those the region had at once
+     */
+    struct bump_chunk *chunk = bump->spare;
+    if (chunk)
+        bump->spare = chunk->prev;
+    if (chunk &&
+        (size_t) (chunk->end - (char *) chunk) < chunk_header + size) {
+        bump_free(bump->pool, chunk);
+        chunk = NULL;
+    }
+    if (!chunk) {
+        chunk = bump_malloc(bump->pool, chunk_header + size);
+        if (!chunk)
+            return false;
+        chunk->end = (char *) chunk + chunk_header + size;
+    }
+
+    if (bump->chunk == &bump->first)
+        bump->bottom = chunk;
+    chunk->prev = bump->chunk;
+    bump->chunk = chunk;
+    bump->top = (char *) chunk + chunk_header;
+    bump->end = chunk->end;
+    return true;
+}
+
+void *pool_bump_memalign(pool_bump_t *bump, size_t alignment, size_t size)
+{
+    if (alignment & (alignment - 1) || alignment > PTRDIFF_MAX / 2 ||
+        size > PTRDIFF_MAX / 2)
+        return NULL;
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+
+    size_t pad = -(uintptr_t) bump->top & (alignment - 1);
+    if (pad + size > (size_t) (bump->end - bump->top)) {
+        if (!bump_grow(bump, size + alignment - sizeof(void *)))
+            return NULL;
+        pad = -(uintptr_t) bump->top & (alignment - 1);
+    }
+
+    void *obj = bump->top + pad;
+    bump->top += pad + size;
+    return obj;
+}
+
+void *pool_bump_alloc(pool_bump_t *bump, size_t size)
+{
+    return pool_bump_memalign(bump, sizeof(void *), size);
+}
+
+pool_bump_mark_t pool_bump_mark(const pool_bump_t *bump)
+{
+    return (pool_bump_mark_t){.chunk = bump->chunk, .top = bump->top};
+}
+
+void pool_bump_release(pool_bump_t *bump, pool_bump_mark_t mark)
+{
+    while (bump->chunk != mark.chunk) {
+        struct bump_chunk *prev = bump->chunk->prev;
+        bump_free(bump->pool, bump->chunk);
+        bump->chunk = prev;
+    }
+    bump->top = mark.top;
+    bump->end = bump->chunk->end;
+}
+
+/* The chain is spliced in front of the spare chunks through its bottom, so
+ * the reset takes the same time however long the chain is.
+ */
+void pool_bump_reset(pool_bump_t *bump)
+{
+    if (bump->chunk != &bump->first) {
+        bump->bottom->prev = bump->spare;
+        bump->spare = bump->chunk;
+    }
+    bump->chunk = &bump->first;
+    bump->top = (char *) bump + bump_header;
+    bump->end = bump->first.end;
+}
+
+void pool_bump_destroy(pool_bump_t *bump)
+{
+    if (!bump)
+        return;
+
+    pool_bump_reset(bump);
+    while (bump->spare) {
+        struct bump_chunk *prev = bump->spare->prev;
+        bump_free(bump->pool, bump->spare);
+        bump->spare = prev;
+    }
+    bump_free(bump->pool, bump);
+}
@@ -1,15 +1,130 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "mpool.h"
+#include "mpool_static.h"
 
 #define KB256 (32 << 4)
+
+/* Frames of two fixed sizes, the classes given out of order */
+MPOOL_DEFINE(frames, 1 << 12, 16, 64, 16)
+
+static bool frames_check(void)
+{
+    char foreign[128];
+    void *small = frames_malloc(10);
+    void *large = frames_calloc(40);
+    bool ok = small && large && !frames_malloc(100);
+
+    frames_free(small, 10);
+    frames_free(large, 40);
+    frames_free(foreign, sizeof(foreign)); /* no such class, ignored */
+    ok = ok && frames_malloc(16) == small && frames_malloc(64) == large;
+    frames_reset();
+    return ok;
+}
+
+/* Relocatable blocks among small blocks whose merge is deferred, compacted
+ * a little at a time while blocks come and go between the steps, so that a
+ * step may resume from a block the quick-lists hold.
+ */
+static bool compact_quick(void)
+{
+    enum { nr_blocks = 64, arena_size = 1 << 16, nr_steps = 20000 };
+    static char arena[arena_size];
+    pool_t pool;
+    pool_handle_t *handles[nr_blocks] = {NULL};
+    void *small[nr_blocks] = {NULL};
+
+    if (!pool_init_ex(&pool, arena, arena_size, POOL_QUICK))
+        return false;
+
+    srand(1);
+    bool ok = true;
+    for (int step = 0; ok && step < nr_steps; step++) {
+        int i = rand() % nr_blocks;
+        switch (rand() % 4) {
+        case 0:
+            if (small[i]) {
+                pool_free_ex(&pool, small[i]);
+                small[i] = NULL;
+            } else {
+                small[i] = pool_malloc_ex(&pool, 8 + rand() % 5 * 8);
+            }
+            break;
+        case 1:
+            if (handles[i]) {
+                pool_handle_free_ex(&pool, handles[i]);
+                handles[i] = NULL;
+            } else {
+                handles[i] = pool_handle_alloc_ex(&pool, 16 + rand() % 64);
+            }
+            break;
+        default:
+            pool_compact_ex(&pool, rand() % 128);
+            break;
+        }
+        ok = pool_check_ex(&pool);
+    }
+
+    for (int i = 0; i < nr_blocks; i++) {
+        pool_free_ex(&pool, small[i]);
+        pool_handle_free_ex(&pool, handles[i]);
+    }
+    return ok && pool_check_ex(&pool);
+}
+
+/* Alignments beyond a page, served by mappings of their own whatever the
+ * threshold, resized and released as the others.
+ */
+static bool memalign_large(void)
+{
+    enum { arena_size = 1 << 16 };
+    static char arena[arena_size];
+    pool_t pool;
+
+    if (!pool_init_ex(&pool, arena, arena_size, POOL_FIRST_FIT))
+        return false;
+    pool_set_mmap_threshold_ex(&pool, 1 << 14);
+
+    bool ok = true;
+    for (size_t align = 8192; ok && align <= 1 << 21; align <<= 4) {
+        char *ptr = pool_memalign_ex(&pool, align, 100);
+        ok = ptr && !((uintptr_t) ptr & (align - 1));
+        if (!ok)
+            break;
+        ptr[99] = 1;
+        ptr = pool_realloc_ex(&pool, ptr, 3 * align);
+        ok = ptr && ptr[99] == 1;
+        pool_free_ex(&pool, ptr);
+    }
+
+    pool_stats_t stats;
+    pool_stats_ex(&pool, &stats);
+    ok = ok && !stats.mapped_bytes && pool_check_ex(&pool);
+    pool_destroy_ex(&pool);
+    return ok;
+}
+
 int main()
 {
     char *arr = malloc(sizeof(char) * KB256);
-    bool is_good = pool_init((void *) arr, KB256);
+    bool is_good = pool_init((void *) arr, KB256, POOL_FIRST_FIT);
     int *a1 = pool_malloc(sizeof(int) * 8);
     int *a2 = pool_malloc(sizeof(int) * 8);
     pool_free(a1);
     pool_free(a2);
+
+    if (!frames_check()) {
+        fprintf(stderr, "static allocator failed\n");
+        return 1;
+    }
+    if (!compact_quick()) {
+        fprintf(stderr, "compaction of a POOL_QUICK pool failed\n");
+        return 1;
+    }
+    if (!memalign_large()) {
+        fprintf(stderr, "alignment beyond a page failed\n");
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,208 +1,3059 @@
-
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "list.h"
 #include "mpool.h"
+#include "trace.h"
 
-/* The basic data structure describing a free space arena element */
+/* The basic data structure describing a free space arena element.
+ *
+ * With MPOOL_COMPACT, the links of a free block are 32-bit offsets in words
+ * from the link origin instead of pointers, so the smallest block shrinks
+ * from 4 to 3 words, header and footer included:
+ *
+ *              ┌──────┬──────┬──────┬──────┐
+ *   pointers:  │ size │ prev │ next │footer│
+ *              └──────┴──────┴──────┴──────┘
+ *              ┌──────┬──────┬──────┐
+ *   offsets:   │ size │ p  n │footer│         32-bit prev and next
+ *              └──────┴──────┴──────┘
+ *
+ * The free lists heads then take 4 bytes each in the pool_t too. All the
+ * blocks must lie within 2^31 words of each other, 16 GB on 64-bit, which
+ * is checked when a region is chained.
+ */
 typedef struct block {
-    int size; /**< Size of the data payload */
+    size_t size; /**< Size of the data payload, ORed with the status bits */
+#ifdef MPOOL_DEBUG
+    uintptr_t magic; /**< tells allocated, released and foreign blocks apart */
+#endif
     union {
         char *payload;
+#ifdef MPOOL_COMPACT
+        struct {
+            uint32_t prev, next; /**< offsets of the previous/next block */
+        } link;
+#else
         struct {
             struct list_head list; /**< Pointer to the previous/next block */
         };
+#endif
     };
 } block_t;
 
-/* Size of a memory element, 32 or 64 bits */
+/* Size of a memory element, 32 or 64 bits, two with MPOOL_DEBUG */
 enum {
-    word_size = sizeof(int), /**< size of memory element */
-    log2_word_size = __builtin_ctz(sizeof(int)),
-    header_size = sizeof(block_t), /**< size, previous/next block addresses */
+    word_size = offsetof(block_t, payload), /**< size of memory element */
+    link_size = sizeof(block_t) - word_size, /**< links of a free block */
+    min_payload = link_size + word_size, /**< links, footer */
+    nr_classes = POOL_NR_CLASSES, /**< one size class per power of two */
+    sub_shift = POOL_SUBBIN_SHIFT,
+    nr_sub_bins = 1 << sub_shift, /**< bins splitting a size class */
+    nr_bins = POOL_NR_BINS,
+    pool_max_alignment = 4096, /**< a page on most architectures */
+    good_fit_depth = 8, /**< candidates compared by good-fit */
+    good_fit_slack = 8, /**< good-fit stops on a waste under 1/8 of the size */
+    hugepage_size = 2 << 20, /**< MAP_HUGETLB default page size */
+    trim_pages = 16, /**< free pages worth a madvise() in a mapped pool */
+    region_min_size = 1 << 20, /**< smallest region chained by growth */
 };
 
-static LIST_HEAD(block_head);
+/* Status bits stored in the low bits of block_t.size. Payload sizes are
+ * multiples of word_size, so these bits are always free and the header stays
+ * a single word. A free block with BLOCK_ZERO reads as zero but for its links
+ * and footer, as the never touched pages of a mapping do:
+ * ┌──────┬───────┬──────────────── BLOCK_ZERO ──────────────┬──────┐
+ * │header│ links │ 0000000000000000000000000000000000000000 │footer│
+ * └──────┴───────┴──────────────────────────────────────────┴──────┘
+ *
+ * An allocated block has no use for BLOCK_ZERO, the bit there tells a block
+ * owned by a handle, which pool_compact() may move. A free block never has
+ * BLOCK_PREV_FREE, two free blocks being always merged, the bit alone then
+ * tells a block mapped on its own, out of any arena.
+ *
+ * Blocks, header included, are sized in multiples of the pool alignment and
+ * start one word before an aligned address, so every payload is aligned.
+ */
+enum {
+    BLOCK_INUSE = 1 << 0,     /**< the block is allocated */
+    BLOCK_PREV_FREE = 1 << 1, /**< the previous block is free, see footer */
+    BLOCK_ZERO = 1 << 2,      /**< the free block payload is known zero */
+    BLOCK_HANDLE = BLOCK_ZERO, /**< the allocated block is relocatable */
+    BLOCK_MAPPED = BLOCK_PREV_FREE, /**< without BLOCK_INUSE, see mapped_*() */
+    BLOCK_FLAGS = BLOCK_INUSE | BLOCK_PREV_FREE | BLOCK_ZERO,
+};
 
-/* Used to track arena status during usage and check if no leaks occcur */
-static int pool_size;
-static int pool_free_space;
+/* Instance behind the pool_*() functions without a pool argument */
+static pool_t default_pool;
 
 /* Find free space when allocating */
-static inline block_t *get_loc_to_place(int place);
-static inline struct list_head *get_loc_to_free(void *addr);
-static inline void list_replace(struct list_head *from, struct list_head *to);
-static inline void list_insert_before(struct list_head *node,
-                                      struct list_head *after);
-static inline void block_merge(struct list_head *node1,
-                               struct list_head *node2);
+static inline block_t *get_loc_to_place(pool_t *pool, size_t place);
+static inline void free_insert(pool_t *pool, block_t *block);
+static inline void free_remove(pool_t *pool, block_t *block);
+static block_t *region_grow(pool_t *pool, size_t size);
+static void *quick_pop(pool_t *pool, size_t size);
+static void quick_drain(pool_t *pool);
+static void cache_destroy(void *cache);
 
-bool pool_init(void *addr, int size)
+static inline size_t block_size(const block_t *block)
 {
-    if (!addr) /* not a valid memory address */
-        return false;
+    return block->size & ~(size_t) BLOCK_FLAGS;
+}
 
-    if (size <= header_size) /* size is too small, can notstore a header */
-        return false;
+/* Size of an allocated block read by its owner, the lock may not be held */
+static inline size_t block_size_unlocked(const block_t *block)
+{
+    return __atomic_load_n(&block->size, __ATOMIC_RELAXED) &
+           ~(size_t) BLOCK_FLAGS;
+}
+
+/* Physical neighbours, the arena end sentinel is always marked in use and
+ * the first block never has BLOCK_PREV_FREE, so walks stay inside the arena.
+ */
+static inline block_t *block_next(const block_t *block)
+{
+    return (block_t *) ((char *) &block->payload + block_size(block));
+}
 
-    pool_size = size - word_size;
-    pool_free_space = size - word_size;
+static inline block_t *block_prev(const block_t *block)
+{
+    size_t prev_size = *(size_t *) ((char *) block - word_size);
+    return (block_t *) ((char *) block - word_size - prev_size);
+}
 
-    block_t *current = (block_t *) addr;
-    current->size = pool_free_space;
-    list_add(&current->list, &block_head);
-    return true;
+/* Update the BLOCK_PREV_FREE bit of a block which may be in use. Its owner can
+ * read the header without holding the pool lock in POOL_THREAD_SAFE mode,
+ * hence the relaxed atomic accesses, plain moves on common hardware.
+ */
+static inline void block_set_prev_free(block_t *block, bool prev_free)
+{
+    size_t size = __atomic_load_n(&block->size, __ATOMIC_RELAXED);
+    size = prev_free ? size | BLOCK_PREV_FREE : size & ~(size_t) BLOCK_PREV_FREE;
+    __atomic_store_n(&block->size, size, __ATOMIC_RELAXED);
 }
 
-/* Round up a size to the next multiple of 32 or 64 bits size (4 bytes or 8
- * bytes size) */
-static inline int round_up(const int *x)
+/* Copy the size of a free block in its last word, the boundary tag read by
+ * block_prev() of the next block.
+ */
+static inline void block_set_footer(block_t *block)
 {
-    const int offset = (1 << log2_word_size) - 1;
-    return ((*x + offset) >> log2_word_size) << log2_word_size;
+    *(size_t *) ((char *) block_next(block) - word_size) = block_size(block);
 }
 
-static inline void list_replace(struct list_head *from, struct list_head *to)
+/* Free lists, doubly linked through the blocks. The helpers below hide the
+ * links, list.h pointers or MPOOL_COMPACT offsets. A walk goes from
+ * link_first() along link_next(), both NULL past the last block.
+ */
+#ifdef MPOOL_COMPACT
+/* The origin is kept relative to the pool_t, so the offsets stay valid in a
+ * POOL_SHARED arena mapped at another address, its pool_t along.
+ */
+static inline char *link_origin(const pool_t *pool)
 {
-    *to = *from;
-    to->next->prev = to;
-    to->prev->next = to;
+    return (char *) pool + pool->link_base;
 }
 
-void *pool_malloc(int size)
+static inline uint32_t link_of(const pool_t *pool, const block_t *block)
 {
-    if (size <= 0)
-        return NULL;
+    if (!block)
+        return 0;
+    return (uint32_t) (int32_t) (((char *) block - link_origin(pool)) /
+                                 word_size);
+}
 
-    int _size = round_up(&size);
-    if (pool_free_space <= (_size + header_size))
+static inline block_t *link_block(const pool_t *pool, uint32_t link)
+{
+    if (!link)
         return NULL;
+    return (block_t *) (link_origin(pool) + (ptrdiff_t) (int32_t) link *
+                                                word_size);
+}
 
-    block_t *ret = get_loc_to_place(size);
+/* Whether the @size bytes at @addr can be linked to the pool blocks. The
+ * first block ever set up defines the origin, just before it, so that no
+ * block lies at offset 0. The origin is never the pool_t itself, which lies
+ * out of the blocks, so 0 tells it is not set yet.
+ */
+static bool link_reach(pool_t *pool, const void *addr, size_t size)
+{
+    if (!pool->link_base)
+        pool->link_base = (char *) addr - word_size - (char *) pool;
 
-    if (!ret)
-        return NULL;
+    ptrdiff_t lo = ((char *) addr - link_origin(pool)) / word_size;
+    ptrdiff_t hi = lo + (ptrdiff_t) (size / word_size);
+    return lo > INT32_MIN && hi < INT32_MAX;
+}
 
-    block_t *new_block = (block_t *) (&ret->payload + _size);
-    new_block->size = ret->size - word_size - _size;
-    ret->size = _size;
-    list_replace(&ret->list, &new_block->list);
-    pool_free_space -= _size;
-    pool_free_space -= word_size;
-    return &ret->payload;
+static inline void link_init(pool_list_t *head)
+{
+    *head = 0;
 }
 
-void *pool_calloc(int size)
+static inline bool link_empty(const pool_list_t *head)
 {
-    void *ptr = pool_malloc(size);
-    if (!ptr)
-        return NULL;
+    return !*head;
+}
 
-    memset(ptr, 0, size);
-    return ptr;
+static inline block_t *link_first(const pool_t *pool, const pool_list_t *head)
+{
+    return link_block(pool, *head);
 }
 
-void *pool_realloc(void *addr, int size)
+static inline block_t *link_next(const pool_t *pool,
+                                 const pool_list_t *head,
+                                 const block_t *node)
 {
-    void *ptr = pool_malloc(size);
-    if (!ptr)
+    (void) head;
+    return link_block(pool, node->link.next);
+}
+
+static inline block_t *link_prev(const pool_t *pool,
+                                 const pool_list_t *head,
+                                 const block_t *node)
+{
+    (void) head;
+    return link_block(pool, node->link.prev);
+}
+
+static inline void link_push(pool_t *pool, pool_list_t *head, block_t *block)
+{
+    block_t *first = link_first(pool, head);
+    block->link.prev = 0;
+    block->link.next = *head;
+    *head = link_of(pool, block);
+    if (first)
+        first->link.prev = *head;
+}
+
+static inline void link_del(pool_t *pool, pool_list_t *head, block_t *block)
+{
+    block_t *prev = link_prev(pool, head, block);
+    block_t *next = link_next(pool, head, block);
+    if (prev)
+        prev->link.next = block->link.next;
+    else
+        *head = block->link.next;
+    if (next)
+        next->link.prev = block->link.prev;
+}
+#else
+/* The list.h links need no pool, its parameters only match the offsets */
+static inline bool link_reach(pool_t *pool, const void *addr, size_t size)
+{
+    (void) pool, (void) addr, (void) size;
+    return true;
+}
+
+static inline void link_init(pool_list_t *head)
+{
+    INIT_LIST_HEAD(head);
+}
+
+static inline bool link_empty(const pool_list_t *head)
+{
+    return list_empty(head);
+}
+
+static inline block_t *link_first(const pool_t *pool, const pool_list_t *head)
+{
+    (void) pool;
+    return list_empty(head) ? NULL : list_first_entry(head, block_t, list);
+}
+
+static inline block_t *link_next(const pool_t *pool,
+                                 const pool_list_t *head,
+                                 const block_t *node)
+{
+    (void) pool;
+    if (node->list.next == head)
         return NULL;
+    return list_entry(node->list.next, block_t, list);
+}
 
-    memcpy(ptr, addr, size);
-    pool_free(addr);
-    return ptr;
+static inline block_t *link_prev(const pool_t *pool,
+                                 const pool_list_t *head,
+                                 const block_t *node)
+{
+    (void) pool;
+    if (node->list.prev == head)
+        return NULL;
+    return list_entry(node->list.prev, block_t, list);
 }
 
-/* Search for a free space to place a new block */
-static inline block_t *get_loc_to_place(int size)
+static inline void link_push(pool_t *pool, pool_list_t *head, block_t *block)
 {
-    block_t *node;
-    list_for_each_entry (node, &block_head, list) {
-        if (node->size >= (size + header_size))
-            return node;
-    }
-    return NULL;
+    (void) pool;
+    list_add(&block->list, head);
+}
+
+static inline void link_del(pool_t *pool, pool_list_t *head, block_t *block)
+{
+    (void) pool, (void) head;
+    list_del(&block->list);
 }
+#endif
 
-/* Parses the free blocks to find the place to set the one under release.
- * Useful to update the linked list correctly and fast its parsing.
+/* Free space of a POOL_PACKED pool. The sizes of the free blocks are packed
+ * in an array, in words, and each block keeps its index in the array in
+ * place of its links:
  *
- * Follows the different cases to handle:
- * ┌───────┬────────────────────────────────────────────┐
- * │Block 0│          ~~~~~~~~ Free ~~~~~~~~~           │
- * └───────┴────────────────────────────────────────────┘
- * ┌────────────────────────────────────────────┬───────┐
- * │          ~~~~~~~~ Free ~~~~~~~~~           │Block 0│
- * └────────────────────────────────────────────┴───────┘
- * ┌───────────────┬───────┬───────────────────────────┐
- * │ ~~~ Free ~~~  │Block 0│  ~~~~~~~~ Free ~~~~~~~~   │
- * └───────────────┴───────┴───────────────────────────┘
- * ┌───────┬────────────────────────────────────┬───────┐
- * │Block 0│      ~~~~~~~~ Free ~~~~~~~~~       │Block 1│
- * └───────┴────────────────────────────────────┴───────┘
- * ┌───────┬───────┬────────────────────┬───────┬────────┬───────┬───────┐
- * │Block 0│Block 1│   ~~~ Free ~~~     │Block 2│~ Free ~│Block 3│Block 4│
- * └───────┴───────┴────────────────────┴───────┴────────┴───────┴───────┘
- * ┌────────┬───────┬───────┬────────────────────┬───────┬────────┐
- * │~ Free ~│Block 0│Block 1│   ~~~ Free ~~~     │Block 2│~ Free ~│
- * └────────┴───────┴───────┴────────────────────┴───────┴────────┘
+ *   sizes:  │ 12 │  4 │  4 │ 40 │  4 │  4 │ ...   up to 16 per compare
+ *   blocks: │ ▪  │ ▪  │ ▪  │ ▪  │ ▪  │ ▪  │ ...
  *
- *   @addr: pointer to an address to release
+ * A block is removed by moving the last one into its slot. The arrays are
+ * mapped with room for as many free blocks as the arena can hold, so that a
+ * release never fails for lack of memory: only their pages in use are
+ * committed.
+ */
+typedef size_t packed_find_t(const uint32_t *sizes,
+                             size_t i,
+                             size_t n,
+                             uint32_t size);
+
+/* First index from @i up to @n with a size of @size words at least, @n if
+ * none. The SIMD variants skip the sizes too small, many at a time, then
+ * leave the exact index and the tail to this one.
+ */
+static size_t packed_find_scalar(const uint32_t *sizes,
+                                 size_t i,
+                                 size_t n,
+                                 uint32_t size)
+{
+    while (i < n && sizes[i] < size)
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__)
+/* SSE2 is always there on x86-64. Its compares are signed, flipping the
+ * sign bits keeps the unsigned order.
+ */
+static size_t packed_find_sse2(const uint32_t *sizes,
+                               size_t i,
+                               size_t n,
+                               uint32_t size)
+{
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i req = _mm_xor_si128(_mm_set1_epi32(size), bias);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (sizes + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (sizes + i + 4));
+        a = _mm_cmplt_epi32(_mm_xor_si128(a, bias), req);
+        b = _mm_cmplt_epi32(_mm_xor_si128(b, bias), req);
+        if (_mm_movemask_epi8(_mm_and_si128(a, b)) != 0xffff)
+            break;
+    }
+    return packed_find_scalar(sizes, i, n, size);
+}
+
+/* A size is large enough when the unsigned maximum leaves it unchanged */
+__attribute__((target("avx2"))) static size_t packed_find_avx2(
+    const uint32_t *sizes,
+    size_t i,
+    size_t n,
+    uint32_t size)
+{
+    const __m256i req = _mm256_set1_epi32(size);
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (sizes + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (sizes + i + 8));
+        a = _mm256_cmpeq_epi32(_mm256_max_epu32(a, req), a);
+        b = _mm256_cmpeq_epi32(_mm256_max_epu32(b, req), b);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+            break;
+    }
+    return packed_find_scalar(sizes, i, n, size);
+}
+#elif defined(__aarch64__)
+static size_t packed_find_neon(const uint32_t *sizes,
+                               size_t i,
+                               size_t n,
+                               uint32_t size)
+{
+    const uint32x4_t req = vdupq_n_u32(size);
+
+    for (; i + 8 <= n; i += 8) {
+        uint32x4_t a = vcgeq_u32(vld1q_u32(sizes + i), req);
+        uint32x4_t b = vcgeq_u32(vld1q_u32(sizes + i + 4), req);
+        if (vmaxvq_u32(vorrq_u32(a, b)))
+            break;
+    }
+    return packed_find_scalar(sizes, i, n, size);
+}
+#endif
+
+/* Search routine of the packed pools, picked once for the running CPU */
+static packed_find_t *packed_find;
+
+static packed_find_t *packed_select(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return packed_find_avx2;
+    return packed_find_sse2;
+#elif defined(__aarch64__)
+    return packed_find_neon;
+#else
+    return packed_find_scalar;
+#endif
+}
+
+/* Size of a free block in the array, UINT32_MAX words past 32 bits */
+static inline uint32_t packed_words(size_t size)
+{
+    size /= word_size;
+    return size < UINT32_MAX ? size : UINT32_MAX;
+}
+
+/* Index of a free block in the arrays, kept where its links would be */
+static inline uint32_t *packed_slot(block_t *block)
+{
+    return (uint32_t *) &block->payload;
+}
+
+static void *packed_map(size_t len)
+{
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void packed_unmap(struct pool_packed *pk)
+{
+    if (pk->sizes)
+        munmap(pk->sizes, pk->capacity * sizeof(*pk->sizes));
+    if (pk->blocks)
+        munmap(pk->blocks, pk->capacity * sizeof(*pk->blocks));
+}
+
+/* Makes room in the arrays for the free blocks of a pool of @size bytes. A
+ * free block takes the smallest block size at least, and each region may
+ * add one more, the regions being logarithmic in number.
  * Returns:
- *   a pointer to the location where to place the block to release. The place
- *   to use can be on the left or on the right of address passed. If no place
- *   found, returns NULL.
+ *   false if the arrays could not be mapped, they are left unchanged
  */
-static inline struct list_head *get_loc_to_free(void *addr)
+static bool packed_reserve(pool_t *pool, size_t size)
 {
-    /* In case the free block is monolithic, just return its address */
-    if (list_is_singular(&block_head))
-        return block_head.prev;
+    struct pool_packed *pk = &pool->packed;
+    size_t need = size / (word_size + min_payload) + 64;
 
-    block_t *target = container_of(addr, block_t, payload);
-    block_t *node = NULL;
+    if (need <= pk->capacity)
+        return true;
+    if (need < 2 * pk->capacity)
+        need = 2 * pk->capacity;
 
-    list_for_each_entry (node, &block_head, list) {
-        if ((uintptr_t) target < (uintptr_t) node)
+    struct pool_packed grown = {
+        .sizes = packed_map(need * sizeof(*pk->sizes)),
+        .blocks = packed_map(need * sizeof(*pk->blocks)),
+        .count = pk->count,
+        .capacity = need,
+        .rover = pk->rover,
+    };
+    if (!grown.sizes || !grown.blocks) {
+        packed_unmap(&grown);
+        return false;
+    }
+
+    if (pk->count) {
+        memcpy(grown.sizes, pk->sizes, pk->count * sizeof(*pk->sizes));
+        memcpy(grown.blocks, pk->blocks, pk->count * sizeof(*pk->blocks));
+    }
+    packed_unmap(pk);
+    *pk = grown;
+    return true;
+}
+
+static inline void packed_push(pool_t *pool, block_t *block)
+{
+    struct pool_packed *pk = &pool->packed;
+
+    *packed_slot(block) = pk->count;
+    pk->sizes[pk->count] = packed_words(block_size(block));
+    pk->blocks[pk->count++] = block;
+}
+
+static inline void packed_del(pool_t *pool, block_t *block)
+{
+    struct pool_packed *pk = &pool->packed;
+    uint32_t i = *packed_slot(block);
+
+    if (i != --pk->count) {
+        pk->sizes[i] = pk->sizes[pk->count];
+        pk->blocks[i] = pk->blocks[pk->count];
+        *packed_slot(pk->blocks[i]) = i;
+    }
+    if (pk->rover > pk->count)
+        pk->rover = 0;
+}
+
+/* First index from @i up to @n of a block able to hold @size bytes, @n if
+ * none. The sizes past 32 bits are saturated, the block itself tells.
+ */
+static inline size_t packed_scan(const struct pool_packed *pk,
+                                 packed_find_t *find,
+                                 size_t i,
+                                 size_t n,
+                                 size_t size)
+{
+    uint32_t words = packed_words(size);
+
+    for (i = find(pk->sizes, i, n, words);
+         i < n && block_size(pk->blocks[i]) < size;
+         i = find(pk->sizes, i + 1, n, words))
+        ;
+    return i;
+}
+
+/* Same as the list searches, over the packed sizes: only the blocks large
+ * enough are ever touched.
+ */
+static block_t *packed_fit(pool_t *pool, size_t size)
+{
+    struct pool_packed *pk = &pool->packed;
+    packed_find_t *find = __atomic_load_n(&packed_find, __ATOMIC_RELAXED);
+    int fit = pool->flags & POOL_FIT_MASK;
+    size_t n = pk->count, i;
+
+    switch (fit) {
+    case POOL_FIRST_FIT:
+        i = packed_scan(pk, find, 0, n, size);
+        return i < n ? pk->blocks[i] : NULL;
+    case POOL_NEXT_FIT:
+        i = packed_scan(pk, find, pk->rover, n, size);
+        if (i == n &&
+            (i = packed_scan(pk, find, 0, pk->rover, size)) == pk->rover)
+            return NULL;
+        pk->rover = i;
+        return pk->blocks[i];
+    }
+
+    int depth = fit == POOL_GOOD_FIT ? good_fit_depth : 0;
+    block_t *best = NULL;
+    for (i = packed_scan(pk, find, 0, n, size); i < n;
+         i = packed_scan(pk, find, i + 1, n, size)) {
+        size_t node_size = block_size(pk->blocks[i]);
+        if (!best || node_size < block_size(best))
+            best = pk->blocks[i];
+        if (node_size == size)
+            break;
+        if (depth && (node_size - size < size / good_fit_slack || !--depth))
             break;
     }
+    return best;
+}
+
+/* A page of handles, see pool_handle_alloc(). The tables are chained, a
+ * handle never moves once given out.
+ */
+struct pool_handle {
+    void *addr;         /**< payload, or next free handle */
+    unsigned int locks; /**< pool_handle_lock() not yet undone */
+};
 
-    return &node->list;
+struct handle_table {
+    struct handle_table *next;
+    struct pool_handle slots[];
+};
+
+enum {
+    handle_table_size = 4096,
+    nr_table_handles = (handle_table_size - sizeof(struct handle_table)) /
+                       sizeof(struct pool_handle),
+};
+
+/* A region chained to a POOL_GROWABLE pool, its blocks follow the header */
+struct pool_region {
+    struct pool_region *next;
+    size_t size;
+    bool mapped; /**< from mmap(), otherwise from the pool source */
+};
+
+/* First block of the region at @addr, whose payload is placed on an aligned
+ * address
+ */
+static inline block_t *region_first(void *addr, size_t align)
+{
+    uintptr_t start = (uintptr_t) addr + word_size;
+    size_t skip = ((start + align - 1) & ~(uintptr_t) (align - 1)) - start;
+    return (block_t *) ((char *) addr + skip);
 }
 
-static inline void list_insert_before(struct list_head *node,
-                                      struct list_head *after)
+/* Header of a POOL_SHARED arena, the pool_t right after it. The magic tells
+ * the layout too, so a build whose blocks or pool_t differ refuses the arena.
+ */
+struct pool_shared {
+    uint64_t magic; /**< shared_magic() once the pool is laid out */
+    void *addr;     /**< where it was laid out */
+    pool_t pool;
+};
+
+static inline uint64_t shared_magic(void)
 {
-    struct list_head *prev = after->prev;
-    node->prev = prev;
-    node->next = after;
-    after->prev = node;
-    prev->next = node;
+    return 0x6d706f6f6c736872ULL ^ (sizeof(pool_t) << 16 | sizeof(block_t));
 }
 
-static void block_try_merge(struct list_head *node1, struct list_head *node2)
+/* First block of the arena given to pool_init(), NULL if none. The one of a
+ * shared arena is found from the pool_t, wherever the arena is mapped.
+ */
+static inline block_t *pool_base(const pool_t *pool)
 {
-    if (node1 == &block_head || node2 == &block_head)
-        return;
+    if (pool->flags & POOL_SHARED)
+        return region_first(container_of(pool, struct pool_shared, pool) + 1,
+                            pool->align);
+    return pool->base;
+}
+
+/* Lays out the @size bytes at @addr as a single free block, whose payload is
+ * aligned on @align, closed by an end sentinel. Merges stop at the sentinel
+ * and at the first block, so blocks of distinct regions are never merged
+ * and a block is released without looking for its region.
+ *   @zero: the bytes at @addr are all zero
+ * Returns:
+ *   the free block, NULL if too small to contain at least 1 byte
+ */
+static block_t *region_setup(void *addr, size_t size, size_t align, bool zero)
+{
+    size_t skip = (char *) region_first(addr, align) - (char *) addr;
+    if (size < skip + word_size)
+        return NULL;
+    addr = (char *) addr + skip;
+    size -= skip;
+
+    /* The block spans a multiple of the alignment, then comes the sentinel */
+    size = (size - word_size) & ~(align - 1);
+    /* size is too small, can not store a header, the links and the sentinel */
+    if (size < word_size + min_payload)
+        return NULL;
+
+    block_t *block = (block_t *) addr;
+    block->size = size - word_size;
+    block_set_footer(block);
+    if (zero)
+        block->size |= BLOCK_ZERO;
+    block_next(block)->size = BLOCK_INUSE | BLOCK_PREV_FREE;
+    return block;
+}
+
+/* Sets up the lock of a POOL_THREAD_SAFE pool, which the processes mapping
+ * a POOL_SHARED arena share.
+ * Returns:
+ *   0, otherwise an error number
+ */
+static int lock_init(pthread_mutex_t *lock, bool shared)
+{
+    if (!shared)
+        return pthread_mutex_init(lock, NULL);
+
+    pthread_mutexattr_t attr;
+    int err = pthread_mutexattr_init(&attr);
+    if (err)
+        return err;
+    err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (!err)
+        err = pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return err;
+}
+
+static bool pool_setup(pool_t *pool, void *addr, size_t size, int flags)
+{
+    /* not a valid memory address, unless the pool grows from nothing */
+    if (!addr && !(flags & POOL_GROWABLE))
+        return false;
+
+    size_t align = POOL_ALIGNMENT(flags);
+    if (align < word_size)
+        align = word_size;
+    if (align > pool_max_alignment)
+        return false;
+
+    if (flags & POOL_BINNED)
+        flags &= ~POOL_PACKED;
+    if (flags & POOL_PACKED &&
+        !__atomic_load_n(&packed_find, __ATOMIC_RELAXED))
+        __atomic_store_n(&packed_find, packed_select(), __ATOMIC_RELAXED);
+
+    block_t *first = NULL;
+    if (addr &&
+        !(first = region_setup(addr, size, align, flags & POOL_ZEROED)))
+        return false;
+#ifdef MPOOL_COMPACT
+    pool->link_base = 0;
+#endif
+    if (first && !link_reach(pool, first, block_size(first)))
+        return false;
+    pool->packed = (struct pool_packed){0};
+    if (flags & POOL_PACKED && !packed_reserve(pool, size))
+        return false;
 
-    block_t *n1 = container_of(node1, block_t, list);
-    block_t *n2 = container_of(node2, block_t, list);
-    uintptr_t loc = (uintptr_t) (&n1->payload + n1->size);
-    if (loc == (uintptr_t) n2) {
-        list_del(node2);
-        n1->size += word_size + n2->size;
-        pool_free_space += word_size;
+    if (flags & POOL_THREAD_SAFE) {
+        if (lock_init(&pool->lock, flags & POOL_SHARED))
+            return false;
+        /* no thread caches in a shared arena */
+        if (!(flags & POOL_SHARED) &&
+            pthread_key_create(&pool->cache_key, cache_destroy)) {
+            pthread_mutex_destroy(&pool->lock);
+            return false;
+        }
     }
+
+    pool->size = first ? block_size(first) : 0;
+    pool->free_space = pool->size;
+    pool->flags = flags;
+    pool->align = align;
+
+    link_init(&pool->block_head);
+    for (int i = 0; i < nr_bins; i++)
+        link_init(&pool->bins[i]);
+    for (int c = 0; c < nr_classes; c++) {
+        pool->sub_map[c] = 0;
+        pool->free_hist[c] = 0;
+        pool->free_hist_bytes[c] = 0;
+        pool->free_max[c] = 0;
+    }
+    pool->bin_map = 0;
+    pool->rover = NULL;
+    for (int i = 0; i < POOL_NR_QUICK; i++)
+        pool->quick[i] = NULL;
+    pool->nr_quick = 0;
+    pool->remote = NULL;
+    pool->nr_allocs = 0;
+    pool->nr_frees = 0;
+    pool->base = first;
+    pool->map_base = NULL;
+    pool->regions = NULL;
+    pool->source.get = NULL;
+    pool->source.put = NULL;
+    pool->mmap_threshold = 0;
+    pool->mapped_bytes = 0;
+    pool->handles = NULL;
+    pool->free_handles = NULL;
+    pool->compact = NULL;
+
+    if (first)
+        free_insert(pool, first);
+    return true;
 }
 
-void pool_free(void *addr)
+bool pool_init_ex(pool_t *pool, void *addr, size_t size, int flags)
 {
-    block_t *target = container_of(addr, block_t, payload);
-    pool_free_space += target->size;
-    struct list_head *target_after = get_loc_to_free(addr);
-    list_insert_before(&target->list, target_after);
-    block_try_merge(&target->list, target->list.next);
-    block_try_merge(target->list.prev, &target->list);
-}
\ No newline at end of file
+    /* the pool_t of a shared arena lies in the arena */
+    if (flags & POOL_SHARED)
+        return false;
+    return pool_setup(pool, addr, size, flags);
+}
+
+bool pool_init(void *addr, size_t size, int flags)
+{
+    return pool_init_ex(&default_pool, addr, size, flags);
+}
+
+/* Reserves the arena from the kernel rather than from the caller. The mapping
+ * is not accounted up front, a page is only committed once the pool writes a
+ * header in it or hands it out, then given back by block_trim() once free
+ * again.
+ */
+bool pool_map_ex(pool_t *pool, size_t size, int flags)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    int prot = PROT_READ | PROT_WRITE;
+    int map = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *base = MAP_FAILED;
+
+    if (!size || size > SIZE_MAX - hugepage_size)
+        return false;
+
+#ifdef MAP_HUGETLB
+    /* Reserved from hugetlbfs up front, otherwise a page fault with no huge
+     * page left would raise SIGBUS instead of failing here.
+     */
+    if (flags & POOL_HUGEPAGE) {
+        size_t len = (size + hugepage_size - 1) & ~(size_t) (hugepage_size - 1);
+        base = mmap(NULL, len, prot, map | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            page = hugepage_size;
+            size = len;
+        }
+    }
+#endif
+    if (base == MAP_FAILED) {
+        size = (size + page - 1) & ~(page - 1);
+        base = mmap(NULL, size, prot, map | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            return false;
+#ifdef MADV_HUGEPAGE
+        /* no hugetlbfs page reserved, transparent huge pages may still do */
+        if (flags & POOL_HUGEPAGE)
+            madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    /* fresh anonymous pages read as zero */
+    if (!pool_init_ex(pool, base, size, flags | POOL_ZEROED)) {
+        munmap(base, size);
+        return false;
+    }
+    pool->map_base = base;
+    pool->map_size = size;
+    pool->page_size = page;
+    return true;
+}
+
+bool pool_map(size_t size, int flags)
+{
+    return pool_map_ex(&default_pool, size, flags);
+}
+
+/* A shared arena only holds offsets and sizes, its blocks reach the other
+ * processes through the lock only. The modes keeping pointers to private
+ * memory, or to the blocks from another pool field than the lists, are out.
+ */
+pool_t *pool_init_shared(void *addr, size_t size, int flags)
+{
+    struct pool_shared *shared = addr;
+
+    if ((flags & (POOL_GROWABLE | POOL_QUICK | POOL_PACKED)) ||
+        (flags & POOL_FIT_MASK) == POOL_NEXT_FIT)
+        return NULL;
+    /* the blocks align the same at whatever address it is attached */
+    if (!addr || (uintptr_t) addr & (word_size - 1) ||
+        (uintptr_t) addr & (POOL_ALIGNMENT(flags) - 1) ||
+        size < sizeof(*shared))
+        return NULL;
+
+    /* attaching fails until the pool is laid out */
+    __atomic_store_n(&shared->magic, 0, __ATOMIC_RELAXED);
+    if (!pool_setup(&shared->pool, shared + 1, size - sizeof(*shared),
+                    flags | POOL_THREAD_SAFE | POOL_SHARED))
+        return NULL;
+    shared->addr = addr;
+    __atomic_store_n(&shared->magic, shared_magic(), __ATOMIC_RELEASE);
+    return &shared->pool;
+}
+
+pool_t *pool_attach(void *addr)
+{
+    struct pool_shared *shared = addr;
+
+    if (!addr || (uintptr_t) addr & (word_size - 1) ||
+        __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != shared_magic())
+        return NULL;
+#ifndef MPOOL_COMPACT
+    /* the links are pointers into the mapping laid out */
+    if (shared->addr != addr)
+        return NULL;
+#endif
+    if ((uintptr_t) addr & (shared->pool.align - 1))
+        return NULL;
+    return &shared->pool;
+}
+
+void pool_set_source_ex(pool_t *pool, const pool_source_t *source)
+{
+    pool->source = *source;
+}
+
+void pool_set_source(const pool_source_t *source)
+{
+    pool_set_source_ex(&default_pool, source);
+}
+
+void pool_set_mmap_threshold_ex(pool_t *pool, size_t threshold)
+{
+    /* the mappings would be private to this process */
+    if (!(pool->flags & POOL_SHARED))
+        pool->mmap_threshold = threshold;
+}
+
+void pool_set_mmap_threshold(size_t threshold)
+{
+    pool_set_mmap_threshold_ex(&default_pool, threshold);
+}
+
+/* Gets a region of at least @len bytes from the pool source, or from mmap()
+ * which rounds @len up to the page size.
+ */
+static struct pool_region *region_get(pool_t *pool, size_t *len)
+{
+    if (pool->source.get)
+        return pool->source.get(*len, pool->source.arg);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    *len = (*len + page - 1) & ~(page - 1);
+    void *addr = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void region_put(pool_t *pool, void *region, size_t len, bool mapped)
+{
+    if (mapped)
+        munmap(region, len);
+    else if (pool->source.put)
+        pool->source.put(region, len, pool->source.arg);
+}
+
+/* Chains a new region to a POOL_GROWABLE pool, large enough for a block of
+ * @size bytes and at least as large as the pool so far, so the number of
+ * regions stays logarithmic. The live blocks do not move, the region only
+ * adds a free block to the free space:
+ * ┌──────────────┬───┐   ┌──────┬──────────────────────┬───┐
+ * │   region 0   │end│   │header│   ~~~~~ Free ~~~~~   │end│
+ * └──────────────┴───┘   └──────┴──────────────────────┴───┘
+ *   pool_init()           region 1, from the pool source
+ * Returns:
+ *   the new free block, NULL if not growable or no region was obtained
+ */
+static block_t *region_grow(pool_t *pool, size_t size)
+{
+    if (!(pool->flags & POOL_GROWABLE))
+        return NULL;
+
+    /* region header, alignment slack, block header and end sentinel */
+    size_t overhead = sizeof(struct pool_region) + 2 * pool->align +
+                      2 * word_size;
+    if (size > PTRDIFF_MAX - overhead)
+        return NULL;
+
+    size_t need = size + overhead;
+    size_t len = need < pool->size ? pool->size : need;
+    if (len < region_min_size)
+        len = region_min_size;
+
+    bool mapped = !pool->source.get;
+    struct pool_region *region = region_get(pool, &len);
+    if (!region && len > need) { /* settle for the bare minimum */
+        len = need;
+        region = region_get(pool, &len);
+    }
+    if (!region)
+        return NULL;
+    /* room in the packed arrays for the free blocks the region may add */
+    if (!link_reach(pool, region, len) ||
+        (pool->flags & POOL_PACKED &&
+         !packed_reserve(pool, pool->size + len))) {
+        region_put(pool, region, len, mapped);
+        return NULL;
+    }
+
+    region->next = pool->regions;
+    region->size = len;
+    region->mapped = mapped;
+    pool->regions = region;
+
+    block_t *block =
+        region_setup(region + 1, len - sizeof(*region), pool->align, mapped);
+    pool->size += block_size(block);
+    pool->free_space += block_size(block);
+    free_insert(pool, block);
+    return block;
+}
+
+void pool_destroy_ex(pool_t *pool)
+{
+    if (pool->flags & POOL_SHARED)
+        __atomic_store_n(&container_of(pool, struct pool_shared, pool)->magic,
+                         0, __ATOMIC_RELAXED);
+    if (pool->flags & POOL_THREAD_SAFE) {
+        if (!(pool->flags & POOL_SHARED))
+            pthread_key_delete(pool->cache_key);
+        pthread_mutex_destroy(&pool->lock);
+    }
+
+    while (pool->regions) {
+        struct pool_region *region = pool->regions;
+        pool->regions = region->next;
+        region_put(pool, region, region->size, region->mapped);
+    }
+
+    if (pool->map_base) {
+        munmap(pool->map_base, pool->map_size);
+        pool->map_base = NULL;
+    }
+
+    packed_unmap(&pool->packed);
+    pool->packed = (struct pool_packed){0};
+
+    while (pool->handles) {
+        struct handle_table *table = pool->handles;
+        pool->handles = table->next;
+        munmap(table, handle_table_size);
+    }
+    pool->free_handles = NULL;
+    pool->compact = NULL;
+}
+
+/* Round up a size to the next multiple of @align, a power of two */
+static inline size_t round_up(const size_t *x, size_t align)
+{
+    return (*x + align - 1) & ~(align - 1);
+}
+
+/* Index of the size class holding a payload of @size bytes */
+static inline int size_class(size_t size)
+{
+    return nr_classes - 1 - __builtin_clzl(size);
+}
+
+/* Index of the bin holding a payload of @size bytes. Its size class is split
+ * by the bits following the most significant one.
+ */
+static inline int bin_index(size_t size)
+{
+    int c = size_class(size);
+    int sub = c < sub_shift ? 0 : (size >> (c - sub_shift)) & (nr_sub_bins - 1);
+    return c * nr_sub_bins + sub;
+}
+
+/* First non-empty bin above bin @i, or -1 if none, where all the blocks are
+ * larger than the ones of bin @i.
+ */
+static inline int bin_above(const pool_t *pool, int i)
+{
+    int c = i / nr_sub_bins, sub = i % nr_sub_bins;
+
+    unsigned int map = pool->sub_map[c] & (~0U << (sub + 1));
+    if (map)
+        return c * nr_sub_bins + __builtin_ctz(map);
+
+    unsigned long classes =
+        c + 1 < nr_classes ? pool->bin_map & (~0UL << (c + 1)) : 0;
+    if (!classes)
+        return -1;
+    c = __builtin_ctzl(classes);
+    return c * nr_sub_bins + __builtin_ctz(pool->sub_map[c]);
+}
+
+/* Counts a free block of @size bytes in its size class. The largest size of
+ * the class only grows, until a single block is left: it is then exact again.
+ */
+static inline void hist_insert(pool_t *pool, size_t size)
+{
+    int c = size_class(size);
+    pool->free_hist[c]++;
+    pool->free_hist_bytes[c] += size;
+    if (size > pool->free_max[c])
+        pool->free_max[c] = size;
+}
+
+static inline void hist_remove(pool_t *pool, size_t size)
+{
+    int c = size_class(size);
+    pool->free_hist_bytes[c] -= size;
+    if (--pool->free_hist[c] <= 1)
+        pool->free_max[c] = pool->free_hist_bytes[c];
+}
+
+/* Free blocks are kept unordered, a released block is pushed at the head of
+ * its list, either the global one or its size class.
+ */
+static inline void free_insert(pool_t *pool, block_t *block)
+{
+    int c = size_class(block_size(block));
+    hist_insert(pool, block_size(block));
+
+    if (pool->flags & POOL_PACKED) {
+        packed_push(pool, block);
+        return;
+    }
+    if (!(pool->flags & POOL_BINNED)) {
+        link_push(pool, &pool->block_head, block);
+        return;
+    }
+
+    int i = bin_index(block_size(block));
+    link_push(pool, &pool->bins[i], block);
+    pool->sub_map[c] |= 1U << (i % nr_sub_bins);
+    pool->bin_map |= 1UL << c;
+}
+
+/* Must be called before the block size changes, the bin is derived from it */
+static inline void free_remove(pool_t *pool, block_t *block)
+{
+    int c = size_class(block_size(block));
+    hist_remove(pool, block_size(block));
+
+    if (pool->flags & POOL_PACKED) {
+        packed_del(pool, block);
+        return;
+    }
+    if (!(pool->flags & POOL_BINNED)) {
+        if (pool->rover == block)
+            pool->rover = link_next(pool, &pool->block_head, block);
+        link_del(pool, &pool->block_head, block);
+        return;
+    }
+
+    int i = bin_index(block_size(block));
+    link_del(pool, &pool->bins[i], block);
+    if (!link_empty(&pool->bins[i]))
+        return;
+    pool->sub_map[c] &= ~(1U << (i % nr_sub_bins));
+    if (!pool->sub_map[c])
+        pool->bin_map &= ~(1UL << c);
+}
+
+/* Shrinks a free block to a payload of @size bytes once its tail is forked.
+ * The block stays in place in its list unless it moves down to another bin.
+ */
+static inline void free_shrink(pool_t *pool, block_t *block, size_t size)
+{
+    bool rebin = (pool->flags & POOL_BINNED) &&
+                 bin_index(block_size(block)) != bin_index(size);
+
+    if (rebin) {
+        free_remove(pool, block);
+    } else {
+        hist_remove(pool, block_size(block));
+        hist_insert(pool, size);
+    }
+    block->size = size | (block->size & (BLOCK_PREV_FREE | BLOCK_ZERO));
+    block_set_footer(block);
+    if (pool->flags & POOL_PACKED)
+        pool->packed.sizes[*packed_slot(block)] = packed_words(size);
+    if (rebin)
+        free_insert(pool, block);
+}
+
+/* Payload size really reserved for a request of @size bytes, such that the
+ * block, header included, spans a multiple of the pool alignment.
+ */
+static inline size_t payload_size(const pool_t *pool, size_t size)
+{
+    if (size < min_payload) /* room for the links and footer once freed */
+        size = min_payload;
+    size += word_size;
+    return round_up(&size, pool->align) - word_size;
+}
+
+/* Allocates a block of @size bytes at least.
+ *   @zero: if not NULL, set when the payload reads as zero but for the bytes
+ *          cleared by payload_clear()
+ */
+static void *block_alloc_zero(pool_t *pool, size_t size, bool *zero)
+{
+    if (zero)
+        *zero = false;
+    if (!size || size > PTRDIFF_MAX)
+        return NULL;
+
+    size_t _size = payload_size(pool, size);
+    void *quick = quick_pop(pool, _size);
+    if (quick)
+        return quick;
+
+    block_t *ret = NULL;
+    if (pool->free_space >= _size)
+        ret = get_loc_to_place(pool, _size);
+    if (!ret && pool->nr_quick) { /* merge the deferred blocks, then retry */
+        quick_drain(pool);
+        if (pool->free_space >= _size)
+            ret = get_loc_to_place(pool, _size);
+    }
+    if (!ret)
+        ret = region_grow(pool, _size);
+
+    if (!ret)
+        return NULL;
+
+    size_t free_size = block_size(ret);
+    if (zero)
+        *zero = ret->size & BLOCK_ZERO;
+
+    /* Too small to be forked, hand over the whole block */
+    if (free_size < _size + word_size + min_payload) {
+        free_remove(pool, ret);
+        ret->size = (ret->size & ~(size_t) BLOCK_ZERO) | BLOCK_INUSE;
+        block_set_prev_free(block_next(ret), false);
+        pool->free_space -= free_size;
+        return &ret->payload;
+    }
+
+    /* Fork the tail of the free block */
+    free_shrink(pool, ret, free_size - _size - word_size);
+
+    block_t *new_block = block_next(ret);
+    new_block->size = _size | BLOCK_INUSE | BLOCK_PREV_FREE;
+    block_set_prev_free(block_next(new_block), false);
+    pool->free_space -= _size;
+    pool->free_space -= word_size;
+    return &new_block->payload;
+}
+
+static inline void *block_alloc(pool_t *pool, size_t size)
+{
+    return block_alloc_zero(pool, size, NULL);
+}
+
+/* Zeroes the first @size bytes of the block at @addr. Taken from a free block
+ * known zero, only the links and footer it had while free need clearing.
+ */
+static void payload_clear(void *addr, size_t size, bool zero)
+{
+    if (!zero) {
+        memset(addr, 0, size);
+        return;
+    }
+
+    size_t tail =
+        block_size_unlocked(container_of(addr, block_t, payload)) - word_size;
+    memset(addr, 0, size < link_size ? size : link_size);
+    if (tail < size)
+        memset((char *) addr + tail, 0, size - tail);
+}
+
+/* Smallest block of @head able to hold @size bytes. With @depth, only that
+ * many candidates are compared, and a block wasting less than 1/8 of @size
+ * is taken right away.
+ */
+static block_t *list_best_fit(const pool_t *pool,
+                              const pool_list_t *head,
+                              size_t size,
+                              int depth)
+{
+    block_t *best = NULL;
+
+    for (block_t *node = link_first(pool, head); node;
+         node = link_next(pool, head, node)) {
+        size_t node_size = block_size(node);
+        if (node_size < size)
+            continue;
+        if (!best || node_size < block_size(best))
+            best = node;
+        if (node_size == size)
+            break;
+        if (depth && (node_size - size < size / good_fit_slack || !--depth))
+            break;
+    }
+    return best;
+}
+
+/* First block able to hold @size bytes, parsing the list from where the last
+ * search ended, around the list head.
+ */
+static block_t *list_next_fit(pool_t *pool, size_t size)
+{
+    const pool_list_t *head = &pool->block_head;
+    block_t *start = pool->rover ? pool->rover : link_first(pool, head);
+    block_t *node = start;
+
+    while (node) {
+        if (block_size(node) >= size) {
+            pool->rover = node;
+            return node;
+        }
+        node = link_next(pool, head, node);
+        if (!node)
+            node = link_first(pool, head);
+        if (node == start)
+            break;
+    }
+    return NULL;
+}
+
+/* Search a bin able to hold @size bytes. The first block of the exact bin is
+ * tried, then the first block of an upper bin, found in constant time with
+ * the bitmaps, and only as a last resort the rest of the exact bin is
+ * scanned. Best-fit and good-fit compare the blocks of the exact bin first,
+ * then of the upper bin.
+ */
+static inline block_t *bin_find(pool_t *pool, size_t size)
+{
+    int i = bin_index(size), upper = bin_above(pool, i);
+    int fit = pool->flags & POOL_FIT_MASK;
+    block_t *node;
+
+    if (fit == POOL_BEST_FIT || fit == POOL_GOOD_FIT) {
+        int depth = fit == POOL_GOOD_FIT ? good_fit_depth : 0;
+        node = list_best_fit(pool, &pool->bins[i], size, depth);
+        if (node || upper < 0)
+            return node;
+        return list_best_fit(pool, &pool->bins[upper], size, depth);
+    }
+
+    node = link_first(pool, &pool->bins[i]);
+    if (node && block_size(node) >= size)
+        return node;
+
+    if (upper >= 0)
+        return link_first(pool, &pool->bins[upper]);
+
+    for (; node; node = link_next(pool, &pool->bins[i], node)) {
+        if (block_size(node) >= size)
+            return node;
+    }
+    return NULL;
+}
+
+/* Search for a free space to place a new block */
+static inline block_t *get_loc_to_place(pool_t *pool, size_t size)
+{
+    if (pool->flags & POOL_BINNED)
+        return bin_find(pool, size);
+    if (pool->flags & POOL_PACKED)
+        return packed_fit(pool, size);
+
+    switch (pool->flags & POOL_FIT_MASK) {
+    case POOL_NEXT_FIT:
+        return list_next_fit(pool, size);
+    case POOL_BEST_FIT:
+        return list_best_fit(pool, &pool->block_head, size, 0);
+    case POOL_GOOD_FIT:
+        return list_best_fit(pool, &pool->block_head, size, good_fit_depth);
+    }
+
+    for (block_t *node = link_first(pool, &pool->block_head); node;
+         node = link_next(pool, &pool->block_head, node)) {
+        if (block_size(node) >= size)
+            return node;
+    }
+    return NULL;
+}
+
+/* Whether a free block of @size bytes has its pages given back to the kernel,
+ * only in a pool from pool_map()
+ */
+static inline bool block_trimmed(const pool_t *pool, size_t size)
+{
+    return pool->map_base && size >= trim_pages * pool->page_size;
+}
+
+/* Gives back to the kernel the pages of the free @block lying in full between
+ * @from and @to. The pages holding its header, links and footer are kept,
+ * the others read as zero once touched again, and so do the bytes left
+ * between @from and @to once cleared:
+ * ┌──────┬───────┬───┬───────────────────────────────┬───┬──────┐
+ * │header│ links │ 0 │ ░░░░░░░░ MADV_DONTNEED ░░░░░░ │ 0 │footer│
+ * └──────┴───────┴───┴───────────────────────────────┴───┴──────┘
+ * Returns:
+ *   true if all the bytes between @from and @to now read as zero
+ */
+static bool block_trim(pool_t *pool, block_t *block, char *from, char *to)
+{
+    char *first = (char *) &block->payload + link_size;
+    char *last = (char *) block_next(block) - word_size;
+    uintptr_t mask = pool->page_size - 1;
+
+    if (from < first)
+        from = first;
+    if (to > last)
+        to = last;
+
+    if (from >= to)
+        return true;
+
+    char *start = (char *) (((uintptr_t) from + mask) & ~mask);
+    char *end = (char *) ((uintptr_t) to & ~mask);
+    if (start >= end)
+        start = end = to;
+    else if (madvise(start, end - start, MADV_DONTNEED))
+        return false;
+
+    memset(from, 0, start - from);
+    memset(end, 0, to - end);
+    return true;
+}
+
+/* The header of @gone is about to be absorbed by the merge of its block into
+ * @into, so the walk of pool_compact() resumes from the merged block.
+ */
+static inline void compact_merged(pool_t *pool, block_t *gone, block_t *into)
+{
+    if (pool->compact == gone)
+        pool->compact = into;
+}
+
+/* Releases a block, merging it with its physical neighbours when they are
+ * free. The boundary tags give both neighbours in constant time, whatever the
+ * number of free blocks:
+ * ┌───────┬────────────────────────────────────────────┐
+ * │Block 0│          ~~~~~~~~ Free ~~~~~~~~~           │  merge next
+ * └───────┴────────────────────────────────────────────┘
+ * ┌────────────────────────────────────────────┬───────┐
+ * │          ~~~~~~~~ Free ~~~~~~~~~           │Block 0│  merge previous
+ * └────────────────────────────────────────────┴───────┘
+ * ┌───────────────┬───────┬───────────────────────────┐
+ * │ ~~~ Free ~~~  │Block 0│  ~~~~~~~~ Free ~~~~~~~~   │  merge both
+ * └───────────────┴───────┴───────────────────────────┘
+ * ┌───────┬───────┬───────┐
+ * │Block 1│Block 0│Block 2│                              no merge
+ * └───────┴───────┴───────┘
+ *
+ *   @addr: the address of the data block
+ */
+static void block_release(pool_t *pool, void *addr)
+{
+    block_t *target = container_of(addr, block_t, payload);
+    size_t size = block_size(target);
+    pool->free_space += size;
+
+    /* Range which may hold dirty pages. The large free neighbours were
+     * trimmed when released, but for the pages holding their header and
+     * footer.
+     */
+    char *dirty = (char *) target, *dirty_end = (char *) block_next(target);
+    /* Whether the pages out of that range read as zero */
+    bool zero = true;
+
+    block_t *next = block_next(target);
+    if (!(next->size & BLOCK_INUSE)) {
+        free_remove(pool, next);
+        compact_merged(pool, next, target);
+        size += word_size + block_size(next);
+        pool->free_space += word_size;
+        if (block_trimmed(pool, block_size(next))) {
+            dirty_end =
+                (char *) &next->payload + link_size + pool->page_size - 1;
+            zero = next->size & BLOCK_ZERO;
+        } else {
+            dirty_end = (char *) block_next(next);
+        }
+    }
+
+    if (target->size & BLOCK_PREV_FREE) {
+        size_t prev_size = *(size_t *) ((char *) target - word_size);
+        if (block_trimmed(pool, prev_size))
+            dirty = (char *) target - word_size - pool->page_size + 1;
+        compact_merged(pool, target, block_prev(target));
+        target = block_prev(target);
+        free_remove(pool, target);
+        size += word_size + block_size(target);
+        pool->free_space += word_size;
+        if (!block_trimmed(pool, prev_size))
+            dirty = (char *) target;
+        else if (!(target->size & BLOCK_ZERO))
+            zero = false;
+    }
+
+    /* The block before a free one is always in use, they would be merged */
+    target->size = size;
+    block_set_footer(target);
+    block_set_prev_free(block_next(target), true);
+    free_insert(pool, target);
+    if (block_trimmed(pool, size) &&
+        block_trim(pool, target, dirty, dirty_end) && zero)
+        target->size |= BLOCK_ZERO;
+}
+
+/* Resizes an allocated block without moving it. A shrinking block gives its
+ * tail back to the free space, a growing block first absorbs the next block
+ * if this one is free and large enough, then gives back what it does not
+ * need:
+ * ┌───────┬─────────────────────┐      ┌─────────────────┬───────────┐
+ * │Block 0│ ~~~~~~ Free ~~~~~~~ │  ──▶ │     Block 0     │ ~ Free ~~ │
+ * └───────┴─────────────────────┘      └─────────────────┴───────────┘
+ *
+ *   @block: block to resize
+ *   @size: the new number of bytes the block needs to own
+ * Returns:
+ *   false if the block must be moved to get that size
+ */
+static bool block_resize(pool_t *pool, block_t *block, size_t size)
+{
+    if (size > pool->size)
+        return false;
+
+    size_t _size = payload_size(pool, size);
+    size_t cur = block_size(block);
+
+    if (cur < _size) {
+        block_t *next = block_next(block);
+        if (next->size & BLOCK_INUSE)
+            return false;
+
+        size_t next_size = block_size(next);
+        if (cur + word_size + next_size < _size)
+            return false;
+
+        free_remove(pool, next);
+        compact_merged(pool, next, block);
+        pool->free_space -= next_size;
+        cur += word_size + next_size;
+        block->size = cur | (block->size & BLOCK_FLAGS);
+        block_set_prev_free(block_next(block), false);
+    }
+
+    /* Too small to be forked, keep the whole block */
+    if (cur < _size + word_size + min_payload)
+        return true;
+
+    block->size = _size | (block->size & BLOCK_FLAGS);
+    block_t *tail = block_next(block);
+    tail->size = (cur - _size - word_size) | BLOCK_INUSE;
+    block_release(pool, &tail->payload);
+    return true;
+}
+
+/* Allocates a block whose payload is aligned on @alignment, which is larger
+ * than the pool alignment. The block is allocated with enough slack to find
+ * an aligned address far enough from its start to fork a free block in front
+ * of it, then its tail is given back:
+ * ┌─────────┬──────────────┬─────────┐      ┌──────┬───────────┬──────┐
+ * │ header  │    ......    ▲ ....... │  ──▶ │ Free │  Block 0  │ Free │
+ * └─────────┴──────────────┴─────────┘      └──────┴───────────┴──────┘
+ *                          aligned
+ */
+static void *block_memalign(pool_t *pool, size_t alignment, size_t size)
+{
+    size_t lead_min = word_size + payload_size(pool, 1);
+    if (size > PTRDIFF_MAX - alignment - lead_min)
+        return NULL;
+
+    size_t _size = payload_size(pool, size);
+    char *addr = block_alloc(pool, _size + alignment + lead_min);
+    if (!addr)
+        return NULL;
+
+    uintptr_t aligned = ((uintptr_t) addr + alignment - 1) &
+                        ~(uintptr_t) (alignment - 1);
+    if (aligned != (uintptr_t) addr) {
+        while (aligned - (uintptr_t) addr < lead_min)
+            aligned += alignment;
+
+        /* Both addresses are aligned on the pool alignment, so are the two
+         * resulting blocks.
+         */
+        block_t *lead = container_of((void *) addr, block_t, payload);
+        block_t *block = container_of((void *) aligned, block_t, payload);
+        size_t gap = aligned - (uintptr_t) addr;
+        block->size = (block_size(lead) - gap) | BLOCK_INUSE;
+        lead->size = (gap - word_size) | (lead->size & BLOCK_FLAGS);
+        block_release(pool, addr);
+        addr = (char *) aligned;
+    }
+
+    block_resize(pool, container_of((void *) addr, block_t, payload), size);
+    return addr;
+}
+
+/* Carves @n blocks of @size bytes, contiguous, out of the tail of a single
+ * free block, which is forked once whatever @n.
+ * Returns:
+ *   false if no free block can hold them all
+ */
+static bool block_alloc_batch(pool_t *pool, size_t size, int n, void **out)
+{
+    if (size > pool->size)
+        return false;
+
+    size_t _size = payload_size(pool, size);
+    if ((size_t) n > pool->size / (_size + word_size))
+        return false;
+
+    size_t need = n * (_size + word_size);
+    if (pool->free_space < need - word_size)
+        return false;
+
+    block_t *ret = get_loc_to_place(pool, need - word_size);
+    if (!ret)
+        return false;
+
+    size_t free_size = block_size(ret);
+    block_t *block;
+
+    if (free_size < need + min_payload) {
+        /* The first block absorbs the free block and its leftover */
+        free_remove(pool, ret);
+        ret->size = (free_size - (n - 1) * (_size + word_size)) |
+                    BLOCK_INUSE | (ret->size & BLOCK_PREV_FREE);
+        pool->free_space -= free_size;
+        out[0] = &ret->payload;
+        block = block_next(ret);
+        for (int i = 1; i < n; i++) {
+            block->size = _size | BLOCK_INUSE;
+            out[i] = &block->payload;
+            block = block_next(block);
+        }
+        block_set_prev_free(block, false);
+        return true;
+    }
+
+    free_shrink(pool, ret, free_size - need);
+
+    block = block_next(ret);
+    for (int i = 0; i < n; i++) {
+        block->size = _size | BLOCK_INUSE | (i ? 0 : BLOCK_PREV_FREE);
+        out[i] = &block->payload;
+        block = block_next(block);
+    }
+    block_set_prev_free(block, false);
+    pool->free_space -= need;
+    return true;
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(void *const *) a;
+    uintptr_t y = (uintptr_t) *(void *const *) b;
+    return (x > y) - (x < y);
+}
+
+/* Releases @n blocks at once. Once sorted by address, the runs of physically
+ * contiguous blocks are fused into a single block, so each run is merged
+ * with its free neighbours and pushed in the free space only once.
+ */
+static void block_release_batch(pool_t *pool, void **ptrs, int n)
+{
+    qsort(ptrs, n, sizeof(*ptrs), ptr_cmp);
+
+    int i = 0;
+    while (i < n && !ptrs[i])
+        i++;
+
+    while (i < n) {
+        block_t *first = container_of(ptrs[i], block_t, payload);
+        block_t *last = first;
+        size_t size = block_size(first);
+
+        while (++i < n &&
+               container_of(ptrs[i], block_t, payload) == block_next(last)) {
+            last = block_next(last);
+            compact_merged(pool, last, first);
+            size += word_size + block_size(last);
+        }
+
+        first->size = size | (first->size & BLOCK_FLAGS);
+        block_release(pool, &first->payload);
+    }
+}
+
+/* Quick-lists, POOL_QUICK mode only. A small block released is pushed on the
+ * list of its payload size, linked through its first word and left marked in
+ * use, so it is neither merged nor split until the lists are drained.
+ */
+enum {
+    nr_quick_lists = POOL_NR_QUICK,
+    quick_max_size = 256, /**< largest payload deferred */
+    quick_limit = 256,    /**< blocks held before they are all merged */
+};
+
+/* Quick-list of the blocks with a payload of @size bytes, or -1 if none.
+ * Payloads only take sizes one alignment apart, starting from the smallest.
+ */
+static inline int quick_index(const pool_t *pool, size_t size)
+{
+    if (!(pool->flags & POOL_QUICK) || size > quick_max_size)
+        return -1;
+
+    size_t i = (size - payload_size(pool, 1)) >> __builtin_ctzl(pool->align);
+    return i < nr_quick_lists ? (int) i : -1;
+}
+
+/* Takes back a block with a payload of exactly @size bytes, or NULL if none */
+static void *quick_pop(pool_t *pool, size_t size)
+{
+    int i = quick_index(pool, size);
+    if (i < 0 || !pool->quick[i])
+        return NULL;
+
+    void *addr = pool->quick[i];
+    pool->quick[i] = *(void **) addr;
+    pool->nr_quick--;
+    return addr;
+}
+
+/* Merges all the deferred blocks into the free space */
+static void quick_drain(pool_t *pool)
+{
+    for (int i = 0; i < nr_quick_lists; i++) {
+        while (pool->quick[i]) {
+            void *addr = pool->quick[i];
+            pool->quick[i] = *(void **) addr;
+            block_release(pool, addr);
+        }
+    }
+    pool->nr_quick = 0;
+}
+
+/* Releases a block, deferring its merge when small enough */
+static void block_free(pool_t *pool, void *addr)
+{
+    int i = quick_index(pool, block_size(container_of(addr, block_t, payload)));
+    if (i < 0) {
+        block_release(pool, addr);
+        return;
+    }
+
+    if (pool->nr_quick == quick_limit)
+        quick_drain(pool);
+    *(void **) addr = pool->quick[i];
+    pool->quick[i] = addr;
+    pool->nr_quick++;
+}
+
+/* Per-thread caches, POOL_THREAD_SAFE mode only. For every small size class,
+ * each thread keeps a magazine of the blocks it recently released, served
+ * back by malloc() without any locking. The shared free space is only reached,
+ * under the pool lock, to refill an empty magazine. Cached blocks stay marked
+ * in use in the arena.
+ *
+ * free() never takes the lock: the blocks a magazine can not hold are pushed
+ * with a compare-and-swap on the remote stack of the pool, linked through
+ * their first word, then released by the next thread taking the lock:
+ *
+ *   Thread A ──push──┐
+ *   Thread B ──push──┼──▶ remote ──▶ ▪ ──▶ ▪ ──▶ ▪ ──▶ NULL
+ *   Thread C ──push──┘       │
+ *                            └──▶ swapped with NULL under the lock, released
+ *
+ * The stack is only ever emptied as a whole, no block is popped alone from
+ * it, so it is immune to ABA.
+ */
+enum {
+    cache_granule = 16,   /**< payload sizes step between two classes */
+    cache_max_size = 256, /**< largest payload served from the caches */
+    nr_cache_classes = cache_max_size / cache_granule - 1, /**< 32 to 256 */
+    magazine_size = 32,   /**< blocks cached per class and per thread */
+};
+
+struct pool_cache {
+    pool_t *pool;
+    size_t bytes; /**< payloads of the cached blocks */
+    struct magazine {
+        int count;
+        void *slots[magazine_size];
+    } magazines[nr_cache_classes];
+};
+
+/* Class serving a request of @size bytes, or -1 if too large to be cached */
+static inline int cache_class_alloc(size_t size)
+{
+    if (size > cache_max_size)
+        return -1;
+
+    int c = (size + cache_granule - 1) / cache_granule;
+    return c < 2 ? 0 : c - 2;
+}
+
+/* Class a released block of payload @size can serve, or -1 if none */
+static inline int cache_class_free(size_t size)
+{
+    size_t c = size / cache_granule;
+    return c >= 2 && c - 2 < nr_cache_classes ? (int) c - 2 : -1;
+}
+
+static inline int cache_class_size(int c)
+{
+    return (c + 2) * cache_granule;
+}
+
+/* Pushes the chain of blocks from @first to @last on the remote stack */
+static void remote_push(pool_t *pool, void *first, void *last)
+{
+    void *head = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **) last = head;
+    } while (!__atomic_compare_exchange_n(&pool->remote, &head, first, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Releases the blocks of the remote stack, lock held */
+static void remote_drain(pool_t *pool)
+{
+    if (!__atomic_load_n(&pool->remote, __ATOMIC_RELAXED))
+        return;
+
+    void *addr = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+    while (addr) {
+        void *next = *(void **) addr;
+        block_free(pool, addr);
+        addr = next;
+    }
+}
+
+/* Takes the pool lock, then settles the frees pushed in the meantime */
+static inline void pool_lock(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    remote_drain(pool);
+}
+
+static inline size_t cached_size(const void *addr)
+{
+    return block_size_unlocked(container_of(addr, block_t, payload));
+}
+
+/* Give back a whole magazine to the shared free space, lock held */
+static void magazine_flush(pool_t *pool, struct magazine *mag, int count)
+{
+    while (count--)
+        block_free(pool, mag->slots[--mag->count]);
+}
+
+static void cache_flush(pool_t *pool, struct pool_cache *cache)
+{
+    for (int c = 0; c < nr_cache_classes; c++)
+        magazine_flush(pool, &cache->magazines[c], cache->magazines[c].count);
+    cache->bytes = 0;
+}
+
+static void cache_destroy(void *ptr)
+{
+    struct pool_cache *cache = ptr;
+    pool_t *pool = cache->pool;
+
+    pool_lock(pool);
+    cache_flush(pool, cache);
+    block_release(pool, cache);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Allocation through the lock. When the free space is exhausted, the blocks
+ * idling in the calling thread cache are given back before a last attempt.
+ *   @zero: as for block_alloc_zero()
+ */
+static void *cache_malloc_locked(pool_t *pool,
+                                 struct pool_cache *cache,
+                                 size_t size,
+                                 bool *zero)
+{
+    pool_lock(pool);
+    void *ptr = block_alloc_zero(pool, size, zero);
+    if (!ptr && cache) {
+        cache_flush(pool, cache);
+        ptr = block_alloc_zero(pool, size, zero);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+}
+
+/* Cache of the calling thread, created on its first call. Returns NULL if the
+ * arena has no room left for it, the caller then goes through the lock.
+ */
+static struct pool_cache *cache_get(pool_t *pool)
+{
+    struct pool_cache *cache = pthread_getspecific(pool->cache_key);
+    if (cache)
+        return cache;
+
+    pool_lock(pool);
+    cache = block_alloc(pool, sizeof(*cache));
+    pthread_mutex_unlock(&pool->lock);
+    if (!cache)
+        return NULL;
+
+    cache->pool = pool;
+    cache->bytes = 0;
+    for (int c = 0; c < nr_cache_classes; c++)
+        cache->magazines[c].count = 0;
+    pthread_setspecific(pool->cache_key, cache);
+    return cache;
+}
+
+/* A thread making only large requests gets no cache, none would serve them */
+static void *cache_malloc(pool_t *pool, size_t size)
+{
+    int c = cache_class_alloc(size);
+    if (c < 0)
+        return cache_malloc_locked(
+            pool, pthread_getspecific(pool->cache_key), size, NULL);
+
+    struct pool_cache *cache = cache_get(pool);
+    if (!cache)
+        return cache_malloc_locked(pool, cache, size, NULL);
+
+    struct magazine *mag = &cache->magazines[c];
+    if (!mag->count) {
+        /* Refill half of the magazine in a single critical section */
+        pool_lock(pool);
+        while (mag->count < magazine_size / 2) {
+            void *ptr = block_alloc(pool, cache_class_size(c));
+            if (!ptr)
+                break;
+            mag->slots[mag->count++] = ptr;
+            cache->bytes += cached_size(ptr);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!mag->count)
+            return cache_malloc_locked(pool, cache, cache_class_size(c),
+                                       NULL);
+    }
+    void *ptr = mag->slots[--mag->count];
+    cache->bytes -= cached_size(ptr);
+    return ptr;
+}
+
+/* A thread which never allocated has no cache, and does not get one: its
+ * frees all go to the remote stack, back to the threads which allocate.
+ */
+static void cache_free(pool_t *pool, void *addr)
+{
+    block_t *target = container_of(addr, block_t, payload);
+    int c = cache_class_free(block_size_unlocked(target));
+    struct pool_cache *cache =
+        c < 0 ? NULL : pthread_getspecific(pool->cache_key);
+
+    if (!cache) {
+        remote_push(pool, addr, addr);
+        return;
+    }
+
+    struct magazine *mag = &cache->magazines[c];
+    if (mag->count == magazine_size) {
+        /* Chain the older half of the magazine, pushed at once */
+        for (int i = 0; i < magazine_size / 2; i++) {
+            cache->bytes -= cached_size(mag->slots[i]);
+            if (i < magazine_size / 2 - 1)
+                *(void **) mag->slots[i] = mag->slots[i + 1];
+        }
+        remote_push(pool, mag->slots[0], mag->slots[magazine_size / 2 - 1]);
+        mag->count -= magazine_size / 2;
+        memmove(mag->slots, mag->slots + magazine_size / 2,
+                mag->count * sizeof(*mag->slots));
+    }
+    mag->slots[mag->count++] = addr;
+    cache->bytes += block_size_unlocked(target);
+}
+
+/* Blocks mapped on their own. A request of at least pool->mmap_threshold
+ * bytes bypasses the arena and the lock: it gets a private mapping, given
+ * back to the kernel when released. The block has the header of the arena
+ * blocks, BLOCK_MAPPED telling it apart, right after the mapping length:
+ *
+ *   ┌─────────┬─────┬──────┬─────────────────────────────────────┐
+ *   │ ~ pad ~ │ len │header│               payload               │
+ *   └─────────┴─────┴──────┴─────────────────────────────────────┘
+ *   ▲ page aligned         ▲ aligned payload, up to a page further
+ *
+ * So the mapping starts on the page of the header. A payload aligned on more
+ * than a page starts a page in, the mapping cut out of a larger one.
+ */
+static inline bool mmap_wanted(const pool_t *pool, size_t size)
+{
+    return pool->mmap_threshold && size >= pool->mmap_threshold;
+}
+
+static inline bool block_mapped(const block_t *block)
+{
+    size_t size = __atomic_load_n(&block->size, __ATOMIC_RELAXED);
+    return (size & (BLOCK_INUSE | BLOCK_MAPPED)) == BLOCK_MAPPED;
+}
+
+/* Bytes from the mapping start to a payload aligned on @align */
+static inline size_t mapped_offset(size_t align)
+{
+    return (sizeof(size_t) + word_size + align - 1) & ~(align - 1);
+}
+
+static inline size_t *mapped_len(block_t *block)
+{
+    return (size_t *) block - 1;
+}
+
+static inline char *mapped_base(const block_t *block)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (char *) ((uintptr_t) block & ~(uintptr_t) (page - 1));
+}
+
+/* Length of the mapping holding @size bytes @offset bytes in, 0 if too large */
+static size_t mapped_size(size_t offset, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > PTRDIFF_MAX - offset - page)
+        return 0;
+    return (offset + size + page - 1) & ~(page - 1);
+}
+
+/* Writes the header of the block mapped at @base, @len bytes long */
+static block_t *mapped_setup(pool_t *pool,
+                             char *base,
+                             size_t offset,
+                             size_t len)
+{
+    block_t *block = (block_t *) (base + offset - word_size);
+    *mapped_len(block) = len;
+    block->size = (len - offset) | BLOCK_MAPPED;
+    __atomic_fetch_add(&pool->mapped_bytes, len, __ATOMIC_RELAXED);
+    return block;
+}
+
+/* Maps a block of @size bytes, aligned on @align, any power of two. Beyond a
+ * page, @align - page more bytes are mapped, and those around the aligned
+ * block unmapped. Fresh anonymous pages read as zero, the block needs no
+ * clearing for a calloc().
+ */
+static void *mapped_alloc(pool_t *pool, size_t align, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t extra = align > page ? align - page : 0;
+    size_t offset = mapped_offset(align > page ? page : align);
+    size_t len = mapped_size(offset, size);
+    if (!len || len > PTRDIFF_MAX - extra)
+        return NULL;
+
+    char *base = mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (extra) {
+        uintptr_t payload = ((uintptr_t) base + offset + align - 1) &
+                            ~(uintptr_t) (align - 1);
+        size_t lead = payload - offset - (uintptr_t) base;
+        if (lead)
+            munmap(base, lead);
+        if (extra - lead)
+            munmap(base + lead + len, extra - lead);
+        base += lead;
+    }
+    return &mapped_setup(pool, base, offset, len)->payload;
+}
+
+static void mapped_free(pool_t *pool, block_t *block)
+{
+    size_t len = *mapped_len(block);
+
+    __atomic_fetch_sub(&pool->mapped_bytes, len, __ATOMIC_RELAXED);
+    munmap(mapped_base(block), len);
+}
+
+/* Counts the blocks handed out or given back by the public functions. The
+ * thread caches serve them without the lock, hence the atomic accesses in
+ * POOL_THREAD_SAFE mode.
+ */
+static inline void stat_add(const pool_t *pool, unsigned long *counter, int n)
+{
+    if (pool->flags & POOL_THREAD_SAFE)
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    else
+        *counter += n;
+}
+
+/* A POOL_SHARED pool goes through the lock only: the thread caches would
+ * keep blocks from the other processes, and the remote stack links blocks
+ * by pointers, valid in a single process.
+ */
+static void *do_malloc(pool_t *pool, size_t size)
+{
+    if (!size)
+        return NULL;
+
+    if (mmap_wanted(pool, size))
+        return mapped_alloc(pool, pool->align, size);
+    if (pool->flags & POOL_SHARED)
+        return cache_malloc_locked(pool, NULL, size, NULL);
+    if (pool->flags & POOL_THREAD_SAFE)
+        return cache_malloc(pool, size);
+    return block_alloc(pool, size);
+}
+
+/* Same as do_malloc(), the payload zeroed. The cached classes are small, but
+ * the larger blocks may come from pages still or again reading as zero, and
+ * only need their first and last words cleared then.
+ */
+static void *do_calloc(pool_t *pool, size_t size)
+{
+    if (!size)
+        return NULL;
+    if (mmap_wanted(pool, size))
+        return mapped_alloc(pool, pool->align, size);
+
+    bool zero;
+    void *ptr;
+    if (!(pool->flags & POOL_THREAD_SAFE)) {
+        ptr = block_alloc_zero(pool, size, &zero);
+    } else if (pool->flags & POOL_SHARED) {
+        ptr = cache_malloc_locked(pool, NULL, size, &zero);
+    } else if (cache_class_alloc(size) >= 0) {
+        ptr = cache_malloc(pool, size);
+        zero = false;
+    } else {
+        ptr = cache_malloc_locked(
+            pool, pthread_getspecific(pool->cache_key), size, &zero);
+    }
+
+    if (ptr)
+        payload_clear(ptr, size, zero);
+    return ptr;
+}
+
+static void do_free(pool_t *pool, void *addr)
+{
+    if (!addr)
+        return;
+
+    block_t *block = container_of(addr, block_t, payload);
+    if (block_mapped(block)) {
+        mapped_free(pool, block);
+    } else if (pool->flags & POOL_SHARED) {
+        pool_lock(pool);
+        block_free(pool, addr);
+        pthread_mutex_unlock(&pool->lock);
+    } else if (pool->flags & POOL_THREAD_SAFE) {
+        cache_free(pool, addr);
+    } else {
+        block_free(pool, addr);
+    }
+}
+
+/* Checked mode, built with -DMPOOL_DEBUG. The header gets a magic word,
+ * telling a block handed out from one given back, and every payload ends
+ * with canaries, then the requested size:
+ * ┌──────┬───────┬──────────────────────┬────────────┬──────┐
+ * │ size │ magic │     user payload     │ ▒ canary ▒ │ size │
+ * └──────┴───────┴──────────────────────┴────────────┴──────┘
+ * A released payload is poisoned. pool_free() aborts on a double free, an
+ * address of no block, or canaries overwritten past the payload, rather
+ * than letting the free space be corrupted. Otherwise, all these functions
+ * are empty and vanish.
+ */
+#ifdef MPOOL_DEBUG
+enum {
+    debug_canary = 0xa5, /**< fills the payload tail past the requested size */
+    debug_poison = 0xdd, /**< fills a released payload */
+};
+
+#define DEBUG_ALLOCATED ((uintptr_t) 0x6d706f6f6c616c6cULL)
+#define DEBUG_RELEASED ((uintptr_t) 0x6d706f6f6c667265ULL)
+#define DEBUG_TAIL ((size_t) 0x7461696c7461696cULL)
+
+/* Magic word of @block, set to @kind. It is keyed by the block place in the
+ * pool, which is the same for every process mapping a POOL_SHARED arena.
+ */
+static inline uintptr_t debug_magic(const pool_t *pool,
+                                    const block_t *block,
+                                    uintptr_t kind)
+{
+    return kind ^ ((uintptr_t) block - (uintptr_t) pool);
+}
+
+static void debug_fail(const char *what, const void *addr)
+{
+    fprintf(stderr, "mpool: %s %p\n", what, addr);
+    abort();
+}
+
+/* Reserves room for the canaries and the requested size */
+static inline size_t debug_size(size_t size)
+{
+    return size && size <= PTRDIFF_MAX ? size + sizeof(size_t) : size;
+}
+
+static void debug_alloc(const pool_t *pool, void *addr, size_t size)
+{
+    block_t *block = container_of(addr, block_t, payload);
+    size_t *tail = (size_t *) ((char *) addr + block_size_unlocked(block) -
+                               sizeof(size_t));
+
+    block->magic = debug_magic(pool, block, DEBUG_ALLOCATED);
+    memset((char *) addr + size, debug_canary, (char *) tail - (char *) addr -
+                                                   size);
+    *tail = size ^ DEBUG_TAIL;
+}
+
+/* Whether the canaries of an allocated block are intact.
+ *   @size: set to the size it was requested with
+ */
+static bool debug_canaries(const block_t *block, size_t *size)
+{
+    const char *addr = (const char *) &block->payload;
+    size_t payload = block_size_unlocked(block);
+    const size_t *tail = (const size_t *) (addr + payload - sizeof(size_t));
+
+    *size = *tail ^ DEBUG_TAIL;
+    if (*size > payload - sizeof(size_t))
+        return false;
+    for (const char *c = addr + *size; c < (const char *) tail; c++) {
+        if (*(const unsigned char *) c != debug_canary)
+            return false;
+    }
+    return true;
+}
+
+/* Checks a block handed out, whose address is given back by the user.
+ * Returns:
+ *   the size it was requested with
+ */
+static size_t debug_check(const pool_t *pool, void *addr)
+{
+    block_t *block = container_of(addr, block_t, payload);
+    size_t size;
+
+    if ((uintptr_t) addr & (pool->align - 1))
+        debug_fail("invalid pointer", addr);
+    if (block->magic == debug_magic(pool, block, DEBUG_RELEASED))
+        debug_fail("double free of", addr);
+    if (block->magic != debug_magic(pool, block, DEBUG_ALLOCATED))
+        debug_fail("invalid pointer", addr);
+    if (!debug_canaries(block, &size))
+        debug_fail("overflow past the block", addr);
+    return size;
+}
+
+static void debug_free(const pool_t *pool, void *addr)
+{
+    block_t *block = container_of(addr, block_t, payload);
+
+    debug_check(pool, addr);
+    block->magic = debug_magic(pool, block, DEBUG_RELEASED);
+    /* a mapped block is unmapped, any later access faults */
+    if (!block_mapped(block))
+        memset(addr, debug_poison, block_size_unlocked(block));
+}
+#else
+static inline size_t debug_size(size_t size)
+{
+    return size;
+}
+
+static inline void debug_alloc(const pool_t *pool, void *addr, size_t size)
+{
+    (void) pool, (void) addr, (void) size;
+}
+
+static inline void debug_free(const pool_t *pool, void *addr)
+{
+    (void) pool, (void) addr;
+}
+#endif
+
+/* The public functions below all go through such a helper, given the site
+ * of their caller: a wrapper calling the other would be the site otherwise.
+ *   @op: the traced operation, TRACE_TAGGED when @site is a tag
+ */
+static inline void *malloc_at(pool_t *pool,
+                              size_t size,
+                              int op,
+                              const void *site)
+{
+    void *ptr = do_malloc(pool, debug_size(size));
+    if (ptr) {
+        debug_alloc(pool, ptr, size);
+        stat_add(pool, &pool->nr_allocs, 1);
+    }
+    TRACE(op, 0, size, NULL, ptr, site);
+    return ptr;
+}
+
+void *pool_malloc_ex(pool_t *pool, size_t size)
+{
+    return malloc_at(pool, size, TRACE_MALLOC, TRACE_CALLER);
+}
+
+void *pool_malloc(size_t size)
+{
+    return malloc_at(&default_pool, size, TRACE_MALLOC, TRACE_CALLER);
+}
+
+void *pool_malloc_tagged_ex(pool_t *pool, size_t size, const char *tag)
+{
+    return malloc_at(pool, size, TRACE_MALLOC | TRACE_TAGGED, tag);
+}
+
+void *pool_malloc_tagged(size_t size, const char *tag)
+{
+    return malloc_at(&default_pool, size, TRACE_MALLOC | TRACE_TAGGED, tag);
+}
+
+/* An alignment beyond the arena ones is served by a mapping of its own, but
+ * for a POOL_SHARED pool, whose blocks the other processes must see.
+ */
+static void *do_memalign(pool_t *pool, size_t alignment, size_t size)
+{
+    if (!alignment || (alignment & (alignment - 1)))
+        return NULL;
+    if (alignment > pool_max_alignment && (pool->flags & POOL_SHARED))
+        return NULL;
+
+    if (alignment <= pool->align)
+        return do_malloc(pool, size);
+    if (!size)
+        return NULL;
+    if (mmap_wanted(pool, size) || alignment > pool_max_alignment)
+        return mapped_alloc(pool, alignment, size);
+
+    void *ptr;
+    if (pool->flags & POOL_THREAD_SAFE) {
+        pool_lock(pool);
+        ptr = block_memalign(pool, alignment, size);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        ptr = block_memalign(pool, alignment, size);
+    }
+    return ptr;
+}
+
+static inline void *memalign_at(pool_t *pool,
+                                size_t alignment,
+                                size_t size,
+                                const void *site)
+{
+    void *ptr = do_memalign(pool, alignment, debug_size(size));
+    if (ptr) {
+        debug_alloc(pool, ptr, size);
+        stat_add(pool, &pool->nr_allocs, 1);
+    }
+    TRACE(TRACE_MEMALIGN, alignment, size, NULL, ptr, site);
+    return ptr;
+}
+
+void *pool_memalign_ex(pool_t *pool, size_t alignment, size_t size)
+{
+    return memalign_at(pool, alignment, size, TRACE_CALLER);
+}
+
+void *pool_memalign(size_t alignment, size_t size)
+{
+    return memalign_at(&default_pool, alignment, size, TRACE_CALLER);
+}
+
+static inline void *calloc_at(pool_t *pool, size_t size, const void *site)
+{
+    void *ptr = do_calloc(pool, debug_size(size));
+    if (ptr) {
+        debug_alloc(pool, ptr, size);
+        stat_add(pool, &pool->nr_allocs, 1);
+    }
+    TRACE(TRACE_CALLOC, 0, size, NULL, ptr, site);
+    return ptr;
+}
+
+void *pool_calloc_ex(pool_t *pool, size_t size)
+{
+    return calloc_at(pool, size, TRACE_CALLER);
+}
+
+void *pool_calloc(size_t size)
+{
+    return calloc_at(&default_pool, size, TRACE_CALLER);
+}
+
+#ifndef MPOOL_DEBUG
+/* Resizes a mapped block, moved by the kernel without any copy, unless it
+ * falls below the threshold: it is then moved back to the arena if there is
+ * room for it.
+ * Returns:
+ *   the address of the block, NULL if failed, the block then remains
+ */
+static void *mapped_realloc(pool_t *pool, block_t *block, size_t size)
+{
+    size_t old = block_size_unlocked(block);
+
+    if (!mmap_wanted(pool, size)) {
+        void *ptr = do_malloc(pool, size);
+        if (ptr) {
+            memcpy(ptr, &block->payload, old < size ? old : size);
+            mapped_free(pool, block);
+            return ptr;
+        }
+    }
+
+    char *base = mapped_base(block);
+    size_t offset = (char *) &block->payload - base;
+    size_t len = *mapped_len(block);
+    size_t new_len = mapped_size(offset, size);
+    if (!new_len)
+        return NULL;
+    if (new_len == len)
+        return &block->payload;
+
+#ifdef MREMAP_MAYMOVE
+    char *new_base = mremap(base, len, new_len, MREMAP_MAYMOVE);
+    if (new_base == MAP_FAILED)
+        return NULL;
+    __atomic_fetch_sub(&pool->mapped_bytes, len, __ATOMIC_RELAXED);
+    return &mapped_setup(pool, new_base, offset, new_len)->payload;
+#else
+    void *ptr = mapped_alloc(pool, (size_t) 1 << __builtin_ctzl(offset),
+                             size);
+    if (ptr) {
+        memcpy(ptr, &block->payload, old < size ? old : size);
+        mapped_free(pool, block);
+    }
+    return ptr;
+#endif
+}
+
+static void *do_realloc(pool_t *pool, void *addr, size_t size)
+{
+    if (!addr)
+        return do_malloc(pool, size);
+    if (!size)
+        return NULL;
+
+    block_t *block = container_of(addr, block_t, payload);
+    if (block_mapped(block))
+        return mapped_realloc(pool, block, size);
+
+    bool in_place;
+    if (pool->flags & POOL_THREAD_SAFE) {
+        pool_lock(pool);
+        in_place = block_resize(pool, block, size);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        in_place = block_resize(pool, block, size);
+    }
+    if (in_place)
+        return addr;
+
+    void *ptr = do_malloc(pool, size);
+    if (!ptr)
+        return NULL;
+
+    /* grows only, so the old payload is the smaller one */
+    memcpy(ptr, addr, block_size_unlocked(block));
+    do_free(pool, addr);
+    return ptr;
+}
+#else
+/* The block always moves, so that a stale address of it is caught */
+static void *do_realloc(pool_t *pool, void *addr, size_t size)
+{
+    size_t old = addr ? debug_check(pool, addr) : 0;
+    if (addr && !size)
+        return NULL;
+
+    void *ptr = do_malloc(pool, debug_size(size));
+    if (!ptr)
+        return NULL;
+    debug_alloc(pool, ptr, size);
+    if (addr) {
+        memcpy(ptr, addr, old < size ? old : size);
+        debug_free(pool, addr);
+        do_free(pool, addr);
+    }
+    return ptr;
+}
+#endif
+
+static inline void *realloc_at(pool_t *pool,
+                               void *addr,
+                               size_t size,
+                               const void *site)
+{
+    void *ptr = do_realloc(pool, addr, size);
+    if (ptr && !addr)
+        stat_add(pool, &pool->nr_allocs, 1);
+    TRACE(TRACE_REALLOC, 0, size, addr, ptr, site);
+    return ptr;
+}
+
+void *pool_realloc_ex(pool_t *pool, void *addr, size_t size)
+{
+    return realloc_at(pool, addr, size, TRACE_CALLER);
+}
+
+void *pool_realloc(void *addr, size_t size)
+{
+    return realloc_at(&default_pool, addr, size, TRACE_CALLER);
+}
+
+void pool_free_ex(pool_t *pool, void *addr)
+{
+    /* traced first, the address may be handed out again once released */
+    TRACE(TRACE_FREE, 0, 0, addr, NULL, NULL);
+    if (addr) {
+        debug_free(pool, addr);
+        stat_add(pool, &pool->nr_frees, 1);
+    }
+    do_free(pool, addr);
+}
+
+void pool_free(void *addr)
+{
+    pool_free_ex(&default_pool, addr);
+}
+
+size_t pool_usable_size_ex(pool_t *pool, void *addr)
+{
+    if (!addr)
+        return 0;
+#ifdef MPOOL_DEBUG
+    /* the bytes past the request are the canaries */
+    return debug_check(pool, addr);
+#else
+    (void) pool;
+    return block_size_unlocked(container_of(addr, block_t, payload));
+#endif
+}
+
+size_t pool_usable_size(void *addr)
+{
+    return pool_usable_size_ex(&default_pool, addr);
+}
+
+static inline int malloc_batch_at(pool_t *pool,
+                                  size_t size,
+                                  int n,
+                                  void **out,
+                                  const void *site)
+{
+    if (!size || n <= 0)
+        return 0;
+
+    size_t _size = debug_size(size);
+    bool done = false;
+    if (mmap_wanted(pool, _size)) {
+        /* each block gets a mapping of its own, one by one below */
+    } else if (pool->flags & POOL_THREAD_SAFE) {
+        pool_lock(pool);
+        done = block_alloc_batch(pool, _size, n, out);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        done = block_alloc_batch(pool, _size, n, out);
+    }
+
+    /* No single free block is large enough, allocate them one by one */
+    for (int i = 0; !done && i < n; i++) {
+        out[i] = do_malloc(pool, _size);
+        if (!out[i]) {
+            while (i--)
+                do_free(pool, out[i]);
+            return 0;
+        }
+    }
+
+    stat_add(pool, &pool->nr_allocs, n);
+    for (int i = 0; i < n; i++) {
+        debug_alloc(pool, out[i], size);
+        TRACE(TRACE_MALLOC, 0, size, NULL, out[i], site);
+    }
+    return n;
+}
+
+int pool_malloc_batch_ex(pool_t *pool, size_t size, int n, void **out)
+{
+    return malloc_batch_at(pool, size, n, out, TRACE_CALLER);
+}
+
+int pool_malloc_batch(size_t size, int n, void **out)
+{
+    return malloc_batch_at(&default_pool, size, n, out, TRACE_CALLER);
+}
+
+void pool_free_batch_ex(pool_t *pool, void **ptrs, int n)
+{
+    if (n <= 0)
+        return;
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        TRACE(TRACE_FREE, 0, 0, ptrs[i], NULL, NULL);
+        if (!ptrs[i])
+            continue;
+
+        debug_free(pool, ptrs[i]);
+        count++;
+        /* not in the arena, nothing to merge it with */
+        block_t *block = container_of(ptrs[i], block_t, payload);
+        if (block_mapped(block)) {
+            mapped_free(pool, block);
+            ptrs[i] = NULL;
+        }
+    }
+    stat_add(pool, &pool->nr_frees, count);
+
+    if (pool->flags & POOL_THREAD_SAFE) {
+        pool_lock(pool);
+        block_release_batch(pool, ptrs, n);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        block_release_batch(pool, ptrs, n);
+    }
+}
+
+void pool_free_batch(void **ptrs, int n)
+{
+    pool_free_batch_ex(&default_pool, ptrs, n);
+}
+
+/* Relocatable blocks. A block allocated through a handle keeps a pointer back
+ * to it in its last word, so the walk of pool_compact() finds the handle to
+ * update when it moves the block. Each step swaps such a block with the free
+ * block right before it, so that the hole moves up and merges with the free
+ * space past the block:
+ * ┌──────┬───────────────┬──────┐      ┌───────────────┬─────────────┐
+ * │ Free │ Block 0     ▪ │ Free │  ──▶ │ Block 0     ▪ │ ~~~ Free ~~ │
+ * └──────┴───────────────┴──────┘      └───────────────┴─────────────┘
+ *                        ▪ handle of Block 0
+ * A hole stops at the first block which can not move: locked, or allocated
+ * without a handle.
+ */
+static inline struct pool_handle **handle_owner(const block_t *block)
+{
+    return (struct pool_handle **) ((char *) &block->payload +
+                                    block_size(block) - sizeof(void *));
+}
+
+/* Takes a free handle, mapping a new table when none is left, lock held */
+static struct pool_handle *handle_get(pool_t *pool)
+{
+    if (!pool->free_handles) {
+        struct handle_table *table =
+            mmap(NULL, handle_table_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED)
+            return NULL;
+
+        table->next = pool->handles;
+        pool->handles = table;
+        for (int i = nr_table_handles; i--;) {
+            table->slots[i].addr = pool->free_handles;
+            pool->free_handles = &table->slots[i];
+        }
+    }
+
+    struct pool_handle *handle = pool->free_handles;
+    pool->free_handles = handle->addr;
+    return handle;
+}
+
+static inline void handle_put(pool_t *pool, struct pool_handle *handle)
+{
+    handle->addr = pool->free_handles;
+    pool->free_handles = handle;
+}
+
+static pool_handle_t *handle_alloc(pool_t *pool, size_t size)
+{
+    /* the tables are private to a process */
+    if (!size || size > PTRDIFF_MAX - sizeof(void *) ||
+        pool->flags & POOL_SHARED)
+        return NULL;
+
+    struct pool_handle *handle = handle_get(pool);
+    if (!handle)
+        return NULL;
+
+    void *addr = block_alloc(pool, size + sizeof(void *));
+    if (!addr) {
+        handle_put(pool, handle);
+        return NULL;
+    }
+
+    block_t *block = container_of(addr, block_t, payload);
+    block->size |= BLOCK_HANDLE;
+    *handle_owner(block) = handle;
+    handle->addr = addr;
+    handle->locks = 0;
+    return handle;
+}
+
+pool_handle_t *pool_handle_alloc_ex(pool_t *pool, size_t size)
+{
+    pool_handle_t *handle;
+
+    if (pool->flags & POOL_THREAD_SAFE) {
+        pool_lock(pool);
+        handle = handle_alloc(pool, size);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        handle = handle_alloc(pool, size);
+    }
+    if (handle)
+        stat_add(pool, &pool->nr_allocs, 1);
+    return handle;
+}
+
+pool_handle_t *pool_handle_alloc(size_t size)
+{
+    return pool_handle_alloc_ex(&default_pool, size);
+}
+
+/* The lock count is only read by pool_compact(), under the pool lock */
+void *pool_handle_lock_ex(pool_t *pool, pool_handle_t *handle)
+{
+    if (!(pool->flags & POOL_THREAD_SAFE)) {
+        handle->locks++;
+        return handle->addr;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    handle->locks++;
+    void *addr = handle->addr;
+    pthread_mutex_unlock(&pool->lock);
+    return addr;
+}
+
+void *pool_handle_lock(pool_handle_t *handle)
+{
+    return pool_handle_lock_ex(&default_pool, handle);
+}
+
+void pool_handle_unlock_ex(pool_t *pool, pool_handle_t *handle)
+{
+    if (!(pool->flags & POOL_THREAD_SAFE)) {
+        handle->locks--;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    handle->locks--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_handle_unlock(pool_handle_t *handle)
+{
+    pool_handle_unlock_ex(&default_pool, handle);
+}
+
+static void handle_free(pool_t *pool, struct pool_handle *handle)
+{
+    block_t *block = container_of(handle->addr, block_t, payload);
+
+    block->size &= ~(size_t) BLOCK_HANDLE;
+    block_free(pool, handle->addr);
+    handle_put(pool, handle);
+}
+
+void pool_handle_free_ex(pool_t *pool, pool_handle_t *handle)
+{
+    if (!handle)
+        return;
+
+    if (pool->flags & POOL_THREAD_SAFE) {
+        pool_lock(pool);
+        handle_free(pool, handle);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        handle_free(pool, handle);
+    }
+    stat_add(pool, &pool->nr_frees, 1);
+}
+
+void pool_handle_free(pool_handle_t *handle)
+{
+    pool_handle_free_ex(&default_pool, handle);
+}
+
+/* First block of the region following the one closed by the sentinel @end,
+ * in the order pool_check() walks them, NULL past the last one. A NULL @end
+ * gives the first block of the arena.
+ */
+static block_t *compact_region(const pool_t *pool, const block_t *end)
+{
+    struct pool_region *r = pool->regions;
+
+    block_t *base = pool_base(pool);
+    if (!end && base)
+        return base;
+    if (end) {
+        while (r && (uintptr_t) end - (uintptr_t) r >= r->size)
+            r = r->next;
+        /* not in a region, it closes the arena given to pool_init() */
+        r = r ? r->next : pool->regions;
+    }
+    return r ? region_first(r + 1, pool->align) : NULL;
+}
+
+static inline bool block_movable(const block_t *block)
+{
+    return (block->size & (BLOCK_INUSE | BLOCK_HANDLE)) ==
+               (BLOCK_INUSE | BLOCK_HANDLE) &&
+           !(*handle_owner(block))->locks;
+}
+
+/* Moves the block following the free block @hole to the start of the hole.
+ * Returns:
+ *   the free block now past the moved one, merged with its next neighbour
+ */
+static block_t *compact_slide(pool_t *pool, block_t *hole)
+{
+    block_t *block = block_next(hole);
+    size_t hole_size = block_size(hole), size = block_size(block);
+    struct pool_handle *handle = *handle_owner(block);
+
+    free_remove(pool, hole);
+    pool->free_space -= hole_size;
+    hole->size = size | BLOCK_INUSE | BLOCK_HANDLE |
+                 (hole->size & BLOCK_PREV_FREE);
+    memmove(&hole->payload, &block->payload, size);
+    handle->addr = &hole->payload;
+
+    block_t *freed = block_next(hole);
+    freed->size = hole_size | BLOCK_INUSE;
+    block_release(pool, &freed->payload);
+    return freed;
+}
+
+/* The quick-lists are drained first, their blocks would pin the holes */
+static bool compact_step(pool_t *pool, size_t budget)
+{
+    /* merged first, the drain may fold the resume block into another one */
+    quick_drain(pool);
+
+    block_t *block = pool->compact ? pool->compact : compact_region(pool, NULL);
+    size_t spent = 0;
+    while (block && spent < budget) {
+        if (!block_size(block)) {
+            block = compact_region(pool, block);
+            continue;
+        }
+
+        block_t *next = block_next(block);
+        if (!(block->size & BLOCK_INUSE) && block_movable(next)) {
+            spent += block_size(next);
+            block = compact_slide(pool, block);
+        } else {
+            spent += word_size;
+            block = next;
+        }
+    }
+    pool->compact = block;
+    return block != NULL;
+}
+
+bool pool_compact_ex(pool_t *pool, size_t budget)
+{
+    /* no handles, and the walk position would be a pointer */
+    if (pool->flags & POOL_SHARED)
+        return false;
+    if (!(pool->flags & POOL_THREAD_SAFE))
+        return compact_step(pool, budget);
+
+    pool_lock(pool);
+    bool more = compact_step(pool, budget);
+    pthread_mutex_unlock(&pool->lock);
+    return more;
+}
+
+bool pool_compact(size_t budget)
+{
+    return pool_compact_ex(&default_pool, budget);
+}
+
+/* Largest free block, found among the blocks of the upper non-empty bin
+ * only. The first-fit free space is not segregated, the size is then the
+ * largest one kept for the upper size class, exact while its largest block
+ * remains or a single block does. Otherwise it is an upper bound, lowered to
+ * what the class bytes leave once each other block has its 2^c bytes.
+ */
+static size_t largest_free(const pool_t *pool)
+{
+    if (pool->flags & POOL_BINNED) {
+        if (!pool->bin_map)
+            return 0;
+
+        int c = size_class(pool->bin_map);
+        int i = c * nr_sub_bins + size_class(pool->sub_map[c]);
+        size_t largest = 0;
+        for (block_t *node = link_first(pool, &pool->bins[i]); node;
+             node = link_next(pool, &pool->bins[i], node)) {
+            if (block_size(node) > largest)
+                largest = block_size(node);
+        }
+        return largest;
+    }
+
+    int c = nr_classes;
+    while (c-- && !pool->free_hist[c])
+        ;
+    if (c < 0)
+        return 0;
+
+    size_t bound = pool->free_hist_bytes[c] -
+                   ((pool->free_hist[c] - 1) << c);
+    return pool->free_max[c] < bound ? pool->free_max[c] : bound;
+}
+
+void pool_stats_ex(pool_t *pool, pool_stats_t *stats)
+{
+    if (pool->flags & POOL_THREAD_SAFE)
+        pool_lock(pool);
+
+    stats->in_use = pool->size - pool->free_space;
+    stats->free_bytes = pool->free_space;
+    stats->free_blocks = 0;
+    for (int c = 0; c < nr_classes; c++) {
+        stats->free_hist[c] = pool->free_hist[c];
+        stats->free_blocks += pool->free_hist[c];
+    }
+    stats->largest_free = largest_free(pool);
+
+    if (pool->flags & POOL_THREAD_SAFE)
+        pthread_mutex_unlock(&pool->lock);
+
+    stats->nr_allocs = __atomic_load_n(&pool->nr_allocs, __ATOMIC_RELAXED);
+    stats->nr_frees = __atomic_load_n(&pool->nr_frees, __ATOMIC_RELAXED);
+    stats->mapped_bytes =
+        __atomic_load_n(&pool->mapped_bytes, __ATOMIC_RELAXED);
+    stats->fragmentation =
+        stats->free_bytes
+            ? 1.0 - (double) stats->largest_free / stats->free_bytes
+            : 0.0;
+}
+
+void pool_stats(pool_stats_t *stats)
+{
+    pool_stats_ex(&default_pool, stats);
+}
+
+size_t pool_cache_bytes_ex(pool_t *pool)
+{
+    if (!(pool->flags & POOL_THREAD_SAFE) || (pool->flags & POOL_SHARED))
+        return 0;
+
+    const struct pool_cache *cache = pthread_getspecific(pool->cache_key);
+    return cache ? cache->bytes : 0;
+}
+
+size_t pool_cache_bytes(void)
+{
+    return pool_cache_bytes_ex(&default_pool);
+}
+
+static bool check_fail(const char *what, const void *addr)
+{
+    fprintf(stderr, "mpool: %s %p\n", what, addr);
+    return false;
+}
+
+/* Walks the blocks of a region up to its end sentinel, checking their
+ * boundary tags, and counts its free blocks and bytes.
+ */
+static bool check_region(const pool_t *pool,
+                         block_t *block,
+                         size_t *nr_free,
+                         size_t *free_bytes)
+{
+    size_t walked = 0;
+    bool prev_free = false;
+
+    for (; block_size(block); block = block_next(block)) {
+        size_t size = block_size(block);
+        if ((size + word_size) & (pool->align - 1) || size < min_payload ||
+            size > pool->size - walked)
+            return check_fail("bad size for block", block);
+        walked += size + word_size;
+
+        if ((bool) (block->size & BLOCK_PREV_FREE) != prev_free)
+            return check_fail("wrong previous free bit in block", block);
+        prev_free = !(block->size & BLOCK_INUSE);
+        if (prev_free) {
+            if (block->size & BLOCK_PREV_FREE)
+                return check_fail("unmerged free block", block);
+            if (*(size_t *) ((char *) block_next(block) - word_size) != size)
+                return check_fail("bad footer for free block", block);
+            (*nr_free)++;
+            *free_bytes += size;
+        }
+#ifdef MPOOL_DEBUG
+        size_t requested;
+        bool allocated =
+            block->magic == debug_magic(pool, block, DEBUG_ALLOCATED);
+        if (!prev_free && allocated && !debug_canaries(block, &requested))
+            return check_fail("overflow past the block", &block->payload);
+#endif
+    }
+
+    if (!(block->size & BLOCK_INUSE) ||
+        (bool) (block->size & BLOCK_PREV_FREE) != prev_free)
+        return check_fail("bad end sentinel", block);
+    return true;
+}
+
+/* Checks the links of a free list, and that its blocks are free and lie in
+ * bin @bin, if not -1. At most @max blocks are expected in it.
+ */
+static bool check_list(const pool_t *pool,
+                       const pool_list_t *head,
+                       int bin,
+                       size_t max,
+                       size_t *nr)
+{
+    block_t *prev = NULL;
+
+    for (block_t *node = link_first(pool, head); node;
+         prev = node, node = link_next(pool, head, node)) {
+        if (link_prev(pool, head, node) != prev)
+            return check_fail("broken free list link at", node);
+        if (node->size & BLOCK_INUSE)
+            return check_fail("allocated block in the free space", node);
+        if (bin >= 0 && bin_index(block_size(node)) != bin)
+            return check_fail("free block in the wrong bin", node);
+        if (++*nr > max)
+            return check_fail("free list looping at", node);
+    }
+    return true;
+}
+
+/* Checks that the packed arrays hold the @nr_free free blocks, each at the
+ * index it keeps and with its size.
+ */
+static bool check_packed(const pool_t *pool, size_t nr_free)
+{
+    const struct pool_packed *pk = &pool->packed;
+
+    if (pk->count != nr_free || pk->count > pk->capacity)
+        return check_fail("free blocks missing from pool", pool);
+    for (size_t i = 0; i < pk->count; i++) {
+        block_t *node = pk->blocks[i];
+        if (node->size & BLOCK_INUSE)
+            return check_fail("allocated block in the free space", node);
+        if (*packed_slot(node) != i ||
+            pk->sizes[i] != packed_words(block_size(node)))
+            return check_fail("stale packed entry for", node);
+    }
+    return true;
+}
+
+static bool check_pool(const pool_t *pool)
+{
+    size_t nr_free = 0, free_bytes = 0;
+
+    block_t *base = pool_base(pool);
+    if (base && !check_region(pool, base, &nr_free, &free_bytes))
+        return false;
+    for (struct pool_region *r = pool->regions; r; r = r->next) {
+        if (!check_region(pool, region_first(r + 1, pool->align), &nr_free,
+                          &free_bytes))
+            return false;
+    }
+
+    size_t nr_listed = 0, nr_hist = 0;
+    for (int c = 0; c < nr_classes; c++)
+        nr_hist += pool->free_hist[c];
+    if (nr_hist != nr_free || free_bytes != pool->free_space)
+        return check_fail("free space accounting off in pool", pool);
+
+    if (pool->flags & POOL_PACKED)
+        return check_packed(pool, nr_free);
+    if (!(pool->flags & POOL_BINNED))
+        return check_list(pool, &pool->block_head, -1, nr_free, &nr_listed) &&
+               (nr_listed == nr_free ||
+                check_fail("free blocks missing from pool", pool));
+
+    for (int i = 0; i < nr_bins; i++) {
+        int c = i / nr_sub_bins;
+        bool used = pool->sub_map[c] & (1U << (i % nr_sub_bins));
+        if (used == link_empty(&pool->bins[i]) ||
+            (bool) (pool->bin_map & (1UL << c)) != (bool) pool->sub_map[c])
+            return check_fail("stale bitmaps in pool", pool);
+        if (!check_list(pool, &pool->bins[i], i, nr_free, &nr_listed))
+            return false;
+    }
+    return nr_listed == nr_free ||
+           check_fail("free blocks missing from pool", pool);
+}
+
+bool pool_check_ex(pool_t *pool)
+{
+    if (!(pool->flags & POOL_THREAD_SAFE))
+        return check_pool(pool);
+
+    pool_lock(pool);
+    bool ok = check_pool(pool);
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+bool pool_check(void)
+{
+    return pool_check_ex(&default_pool);
+}
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "list.h"
 
 /*
  * A basic malloc/calloc/free implementation.
@@ -26,23 +32,28 @@
  *
  * A free block is composed first by a register describing the block size,
  * then by two pointers. So the free space is described by a linked list to
- * parse and manipulate it fastly.
+ * parse and manipulate it fastly. Its last word repeats the size, this
+ * boundary tag lets the next block find the beginning of a free neighbour.
  *
  *
  *                            Free block                  In-use block
  *
  *                        ┌────────────────┐           ┌────────────────┐
- *                        │      Size      │           │      Size      │
+ *                        │   Size | bits  │           │   Size | bits  │
  *                        ├────────────────┤           ├────────────────┤
  *                        │ Next Block Ptr │           │                │
  *                        ├────────────────┤           │                │
  *                        │Prev. Block Ptr │           │    Payload     │
  *                        ├────────────────┤           │                │
- *                        │                │           │                │
  *                        │    ........    │           │                │
- *                        │                │           │                │
+ *                        ├────────────────┤           │                │
+ *                        │      Size      │           │                │
  *                        └────────────────┘           └────────────────┘
  *
+ * Sizes are multiples of the word size, the low bits of the register store
+ * whether the block is in use and whether the previous one is free. A last
+ * word, always marked in use, closes the arena.
+ *
  * Free blocks store the links to the next and previous free block, so,
  * malloc() and free() can use these links to parse the pool, allocate a chunk
  * or release it. On allocation, if no region is able to store the requested
@@ -70,58 +81,648 @@
  *
  * # free()
  *
- * 1. Locate the block to free accross the chained list. nxt/prv pointers are
- *    used to move until the position is found. Ensure the block is not the
- *    last or the first around the space boundary
- * 2. If next block is contiguous, merge it:
- *   - Erase next block info if existing
+ * 1. Locate the physical neighbours: the next block starts right after the
+ *    payload, the previous one, when flagged free, starts at the address
+ *    given by its footer. No parsing of the free space is needed.
+ * 2. If next block is free, merge it:
+ *   - Unlink next block from the free space
  *   - Add current block size with next block size
- *   - Update next.nxt block to point to the new current block address
- * 3. If previous block is contiguous, merge it:
+ * 3. If previous block is free, merge it:
+ *   - Unlink previous block from the free space
  *   - update the size of the previous block by adding the chunk size
- *   - update the current.nxt block's prv pointer to the new merged block
- * address
+ * 4. Write the footer, flag the next block, and push the merged block at the
+ *    head of the free space, which is not kept in address order.
+ *
+ * # Segregated free lists
+ *
+ * When the pool is initialized with POOL_BINNED, free blocks are linked in
+ * size bins instead, as in TLSF: every power of two of the payload size is a
+ * class, split in 8 bins of the same width:
+ *
+ *   class 6: [64, 128)   bin [64, 72)   ──▶ Free ──▶ Free
+ *                        bin [72, 80)   ──▶ (empty)
+ *                        ...
+ *                        bin [120, 128) ──▶ Free
+ *   class 7: [128, 256)  bin [128, 144) ──▶ (empty)
+ *   ...
+ *
+ * A first bitmap records the classes holding a non-empty bin, then one
+ * bitmap per class its non-empty bins, so malloc() finds a bin whose blocks
+ * are all large enough with two bit scans, whatever the number of free
+ * blocks and their sizes, instead of parsing the whole free space. The
+ * blocks of a bin are at most 1/8 apart, so the first one is a good fit. A
+ * free block is linked in its bin only.
+ *
+ * # Placement policies
+ *
+ * The fit policy chosen at pool_init() picks which of the large enough blocks
+ * is split, trading the allocation latency against the fragmentation:
+ *
+ *   first-fit  the first one found, small leftovers pile up at the list head
+ *   next-fit   the first one found from where the last search ended, which
+ *              spreads the leftovers over the whole free space
+ *   best-fit   the smallest one, which leaves the smallest leftover but
+ *              parses the whole list unless an exact fit is found
+ *   good-fit   best-fit among the first candidates only, a close enough fit
+ *              ending the search right away
+ *
+ * With POOL_BINNED, the policy applies inside the bins searched: best-fit and
+ * good-fit parse the exact bin, then the first upper non-empty one. Next-fit
+ * has no roving pointer per bin and behaves as first-fit.
+ *
+ * # Thread safety
+ *
+ * A pool initialized with POOL_THREAD_SAFE can be shared by several threads.
+ * Each thread owns a cache holding, per small size class, a magazine of the
+ * blocks it released lately:
+ *
+ *   Thread A           Thread B
+ *   ┌──────────┐       ┌──────────┐
+ *   │ 32: ▪▪▪  │       │ 32: ▪    │      malloc()/free() without lock
+ *   │ 48: ▪    │       │ 48: ▪▪▪▪ │
+ *   │ ...      │       │ ...      │
+ *   └────┬─────┘       └────┬─────┘
+ *        └──── lock ────────┘           refill empty / flush full magazine
+ *              Free space
+ *
+ * Larger blocks are allocated through the lock. A free() never takes it:
+ * what a magazine can not hold, larger blocks or blocks released by a thread
+ * which never allocates, is pushed on a lock-free stack, then merged by the
+ * next thread taking the lock. Cached blocks still count as allocated in the
+ * arena until the thread flushes them or exits.
+ *
+ * # Deferred coalescing
+ *
+ * With POOL_QUICK, a small block released is not merged right away but
+ * pushed on a quick-list, one per payload size, still marked in use so that
+ * its neighbours leave it alone. A malloc() of the same size pops it back
+ * without splitting anything:
+ *
+ *   24: ──▶ ▪ ──▶ ▪ ──▶ ▪
+ *   32: ──▶ ▪
+ *   ...                        free() pushes, malloc() pops
+ *   256: (empty)
+ *
+ * The quick-lists are coalesced in one go once they hold too many blocks, or
+ * when an allocation finds no fit in the free space. Until then, their
+ * blocks count as allocated in the arena.
+ *
+ * # Packed sizes
+ *
+ * With POOL_PACKED, the free space of the first-fit family of modes is not
+ * a list but a dense array of sizes, next to the array of the blocks. The
+ * fit searches then compare up to 16 sizes per instruction, with the SIMD
+ * extension the CPU turns out to have at run time, instead of touching a
+ * cache line per free block.
+ *
+ * # Shared arenas
+ *
+ * pool_init_shared() lays the pool_t out at the start of the arena itself,
+ * so a shared memory segment or a mapped file holds the whole pool, which
+ * other processes reopen with pool_attach(), and which outlives them:
+ *
+ *   ┌────────┬────────┬─────────┬──────┬─────────┬─────────────┐
+ *   │ header │ pool_t │ Block 0 │ Free │ Block 2 │ ~~ Free ~~~ │
+ *   └────────┴────────┴─────────┴──────┴─────────┴─────────────┘
+ *                 └─ free lists ──────▲───────────────────▲
+ *
+ * Built with MPOOL_COMPACT, the links are offsets from the pool_t, the arena
+ * may then be mapped at a different address by every process. Otherwise
+ * they are pointers, and the arena must be mapped at the same address.
  */
 
+/* Allocation modes, selected once for all by pool_init(). A placement policy
+ * can be combined with the other flags.
+ */
+enum pool_flags {
+    POOL_FIRST_FIT = 0,    /**< parse the free space, the default */
+    POOL_BINNED = 1 << 0,  /**< segregated power of two size classes */
+    POOL_THREAD_SAFE = 1 << 1, /**< lock, with per-thread caches in front */
+    POOL_NEXT_FIT = 1 << 2, /**< first-fit from where the last search ended */
+    POOL_BEST_FIT = 2 << 2, /**< smallest block large enough */
+    POOL_GOOD_FIT = 3 << 2, /**< best-fit, over a bounded search */
+    POOL_FIT_MASK = 3 << 2, /**< placement policy bits */
+    POOL_HUGEPAGE = 1 << 4, /**< huge pages backing pool_map() arenas */
+    POOL_GROWABLE = 1 << 5, /**< chain new regions once exhausted */
+    POOL_QUICK = 1 << 6,    /**< defer the merge of small blocks released */
+    POOL_ZEROED = 1 << 7,   /**< the arena given to pool_init() reads as zero */
+    POOL_PACKED = 1 << 8,   /**< free sizes in an array, not with POOL_BINNED */
+    POOL_SHARED = 1 << 9,   /**< set by pool_init_shared(), across processes */
+};
+
+/* Default alignment of the payloads, ORed with the mode given to pool_init().
+ * Without it, payloads are aligned on the word size.
+ *   @alignment: a power of two, up to 4096
+ */
+#define POOL_ALIGN(alignment) (__builtin_ctz(alignment) << 16)
+#define POOL_ALIGNMENT(flags) (1 << (((flags) >> 16) & 0xff))
+
+/* Size classes, one per power of two, each split in 2^POOL_SUBBIN_SHIFT bins */
+#define POOL_NR_CLASSES (sizeof(size_t) * 8)
+#define POOL_SUBBIN_SHIFT 3
+#define POOL_NR_BINS (POOL_NR_CLASSES << POOL_SUBBIN_SHIFT)
+
+/* Quick-lists of a POOL_QUICK pool, one per small payload size */
+#define POOL_NR_QUICK 32
+
+/* Source of the regions chained by a POOL_GROWABLE pool, mmap() by default.
+ * A region must be pointer aligned. In a pool from pool_map(), its free pages
+ * are given back with madvise(), it must then be an anonymous mapping.
+ */
+typedef struct pool_source {
+    void *(*get)(size_t size, void *arg); /**< region of @size bytes or NULL */
+    void (*put)(void *addr, size_t size, void *arg); /**< to release it */
+    void *arg; /**< handed over to both callbacks */
+} pool_source_t;
+
+/* Head of a free list, a block offset with MPOOL_COMPACT, see mpool.c */
+#ifdef MPOOL_COMPACT
+typedef uint32_t pool_list_t;
+#else
+typedef struct list_head pool_list_t;
+#endif
+
+/* An arena and its bookkeeping. Every pool_*_ex() function works on the
+ * pool given as first argument, so independent arenas can live side by side,
+ * one per subsystem or per thread, without sharing anything. The pool_*()
+ * functions without a pool argument work on a default instance.
+ *
+ * The lists head into the structure itself: a pool must not be copied or
+ * moved once initialized.
+ */
+typedef struct pool {
+    pool_list_t block_head; /**< free space in POOL_FIRST_FIT mode */
+    pool_list_t bins[POOL_NR_BINS]; /**< size bins, POOL_BINNED */
+    unsigned long bin_map; /**< bit i set when class i has a non-empty bin */
+    unsigned char sub_map[POOL_NR_CLASSES]; /**< non-empty bins per class */
+    void *rover; /**< block where the next search starts, next-fit */
+    struct pool_packed {
+        uint32_t *sizes; /**< free block sizes in words, saturated */
+        void **blocks;   /**< the free blocks, in the same order */
+        size_t count;    /**< free blocks in the arrays */
+        size_t capacity; /**< room of the arrays */
+        size_t rover;    /**< where the next search starts, next-fit */
+    } packed;            /**< free space in POOL_PACKED mode */
+    void *quick[POOL_NR_QUICK]; /**< blocks released, unmerged, POOL_QUICK */
+    int nr_quick;               /**< blocks held by the quick-lists */
+    int flags;            /**< mode given to pool_init() */
+    size_t align;         /**< alignment of every payload */
+    size_t size;          /**< arena size, the headers aside */
+    size_t free_space; /**< used to check if no leaks occur during usage */
+    size_t free_hist[POOL_NR_CLASSES];       /**< free blocks per size class */
+    size_t free_hist_bytes[POOL_NR_CLASSES]; /**< their bytes, per class */
+    size_t free_max[POOL_NR_CLASSES]; /**< largest free size, upper bound */
+    unsigned long nr_allocs;     /**< blocks handed out */
+    unsigned long nr_frees;      /**< blocks given back */
+    pthread_mutex_t lock;    /**< guards the free space, POOL_THREAD_SAFE */
+    pthread_key_t cache_key; /**< per-thread caches, POOL_THREAD_SAFE */
+    void *remote; /**< blocks freed without the lock, POOL_THREAD_SAFE */
+    void *base;       /**< first block of the arena given to pool_init() */
+#ifdef MPOOL_COMPACT
+    ptrdiff_t link_base; /**< origin of the list offsets, from the pool */
+#endif
+    void *map_base;   /**< mapping from pool_map(), NULL otherwise */
+    size_t map_size;  /**< length of the mapping */
+    size_t page_size; /**< page size of the mapping */
+    struct pool_region *regions; /**< chained by growth, latest first */
+    pool_source_t source;        /**< where the regions come from */
+    size_t mmap_threshold; /**< requests mapped on their own, 0 if none */
+    size_t mapped_bytes;   /**< length of the blocks mapped on their own */
+    struct handle_table *handles; /**< tables of pool_handle_alloc() */
+    struct pool_handle *free_handles; /**< handles not in use */
+    void *compact; /**< block where the next pool_compact() resumes */
+} pool_t;
+
 /* Called by the environment to setup the arena start address.
  * To call once when the system boots up or when creating
- * a new pool arena.
- *   @addr: address of the arena's first byte
+ * a new pool arena. A POOL_GROWABLE pool may start from no arena at all and
+ * get its first region on the first allocation.
+ *   @addr: address of the arena's first byte, or NULL if POOL_GROWABLE
  *   @size: size in byte available for the arena
+ *   @flags: allocation mode, a combination of enum pool_flags
  * Returns:
  *   false if size is too small to contain at least 1 byte, otherwise true
  */
-bool pool_init(void *addr, int size);
+bool pool_init(void *addr, size_t size, int flags);
+
+/* Virtual memory backed arena.
+ * Same as pool_init(), but the arena is reserved with mmap() instead of
+ * being given by the caller. Pages are committed lazily, on first use, and
+ * the pages lying inside large free blocks are given back to the kernel with
+ * madvise(MADV_DONTNEED): the resident size follows the memory really in use
+ * rather than its peak. Released by pool_destroy_ex().
+ *   @size: size in byte of the arena, rounded up to the page size
+ *   @flags: allocation mode, with POOL_HUGEPAGE to back the arena with
+ *           hugetlbfs pages when reserved, transparent huge pages otherwise
+ * Returns:
+ *   false if the range can not be mapped or is too small, otherwise true
+ */
+bool pool_map(size_t size, int flags);
+
+/* Region source.
+ * Once no free block of a POOL_GROWABLE pool can hold a request, a new region
+ * at least as large as the pool so far is chained, its space added to the
+ * free space, without moving the live blocks. The blocks of every region are
+ * released as the others, the end of a region bounds the merges. The regions
+ * are given back by pool_destroy_ex().
+ *   @source: the callbacks, copied, mmap() is used when get is NULL
+ */
+void pool_set_source(const pool_source_t *source);
+
+/* Large allocation bypass.
+ * A request of at least @threshold bytes is not served from the arena but
+ * by a private mapping of its own, unmapped once released and resized with
+ * mremap() by pool_realloc(), so large transient buffers neither split the
+ * free space nor pin its fragmentation until released. Meant to be set
+ * before any allocation, a POOL_SHARED pool ignores it. The blocks left
+ * mapped are not given back by pool_destroy_ex().
+ *   @threshold: the smallest size mapped, 0 to never map, the default
+ */
+void pool_set_mmap_threshold(size_t threshold);
 
 /* Memory allocation.
  * Allocates in the arena a buffer of @size bytes. Memory blocked reserved in
  * memory are always boundary aligned with the hardware architecture, so
- * 4 bytes for 32 bits architecture, or 8 bytes for 64 bits architecture. Use
- * first-fit startegy for the moment.
+ * 4 bytes for 32 bits architecture, or 8 bytes for 64 bits architecture, or
+ * on the alignment given with POOL_ALIGN() to pool_init(). The block is
+ * placed according to the fit policy given to pool_init().
  *   @size: the number of bytes the block needs to own
  * Returns:
  *   the address of the buffer's first byte, otherwise -1 if failed
  */
-void *pool_malloc(int size);
+void *pool_malloc(size_t size);
+
+/* Aligned allocation.
+ * Same as pool_malloc() but the payload address is a multiple of @alignment,
+ * for instance to hold SIMD vectors or cache line padded data. Beyond 4096,
+ * the block is mapped on its own as with pool_set_mmap_threshold(), a
+ * POOL_SHARED pool then fails.
+ *   @alignment: a power of two
+ *   @size: the number of bytes the block needs to own
+ * Returns:
+ *   the address of the buffer's first byte, otherwise NULL if failed
+ */
+void *pool_memalign(size_t alignment, size_t size);
 
 /* Clear allocation.
- * Same as pool_malloc() but erase with zero the zone allocated.
+ * Same as pool_malloc() but erase with zero the zone allocated. The free
+ * blocks still reading as zero are tracked, those of a POOL_ZEROED or mapped
+ * arena never used and those given back to the kernel, so a large block
+ * taken from them is not written over again.
  *   @size: the number of bytes the block needs to own
  * Returns:
  *  - the address of the buffer's first byte, otherwise -1 if failed
  */
-void *pool_calloc(int size);
+void *pool_calloc(size_t size);
 
 /* Used to place existibng block in a wider space.
- * If failed, the existing block remains.
+ * The block is resized in place when shrinking, or when growing into the next
+ * block if free. Otherwise it moves, only the old payload being copied. If
+ * failed, the existing block remains. A NULL @addr behaves as pool_malloc().
  *   @addr: address of the chunk to move
  *   @size: size in byte of the chunk
  * Returns:
- *   NULL if failed to allocate the new block
+ *   the address of the block, NULL if failed to allocate the new block
  */
-void *pool_realloc(void *addr, int size);
+void *pool_realloc(void *addr, size_t size);
 
 /* Releases a block and make it available again for future use.
  *   @addr: the address of the data block
  */
-void pool_free(void *addr);
\ No newline at end of file
+void pool_free(void *addr);
+
+/* Bytes of the block at @addr the caller may use, at least the size asked
+ * for, as malloc_usable_size() does.
+ *   @addr: the address of the data block, NULL gives 0
+ */
+size_t pool_usable_size(void *addr);
+
+/* Batch allocation.
+ * Allocates @n blocks of @size bytes, carved in a single pass out of one free
+ * region when possible, one by one otherwise.
+ *   @size: the number of bytes each block needs to own
+ *   @n: the number of blocks
+ *   @out: array receiving the @n block addresses
+ * Returns:
+ *   @n, otherwise 0 if failed, then no block is allocated
+ */
+int pool_malloc_batch(size_t size, int n, void **out);
+
+/* Batch release.
+ * Releases @n blocks at once, merging the contiguous ones together before
+ * merging them with the free space. @ptrs is sorted by address on return,
+ * the blocks mapped on their own cleared to NULL.
+ *   @ptrs: the addresses of the data blocks, NULL entries are ignored
+ *   @n: the number of addresses
+ */
+void pool_free_batch(void **ptrs, int n);
+
+/* Same as the functions above, working on @pool instead of the default
+ * instance. A block must be released or reallocated by the pool which
+ * allocated it.
+ */
+bool pool_init_ex(pool_t *pool, void *addr, size_t size, int flags);
+bool pool_map_ex(pool_t *pool, size_t size, int flags);
+void pool_set_source_ex(pool_t *pool, const pool_source_t *source);
+void pool_set_mmap_threshold_ex(pool_t *pool, size_t threshold);
+void *pool_malloc_ex(pool_t *pool, size_t size);
+void *pool_memalign_ex(pool_t *pool, size_t alignment, size_t size);
+void *pool_calloc_ex(pool_t *pool, size_t size);
+void *pool_realloc_ex(pool_t *pool, void *addr, size_t size);
+void pool_free_ex(pool_t *pool, void *addr);
+size_t pool_usable_size_ex(pool_t *pool, void *addr);
+int pool_malloc_batch_ex(pool_t *pool, size_t size, int n, void **out);
+void pool_free_batch_ex(pool_t *pool, void **ptrs, int n);
+
+/* Usage snapshot of a pool, filled by pool_stats() */
+typedef struct pool_stats {
+    size_t in_use;       /**< allocated bytes, headers and caches included */
+    size_t free_bytes;   /**< bytes available in the free blocks */
+    size_t free_blocks;  /**< number of free blocks */
+    size_t largest_free; /**< payload of the largest free block, see below */
+    size_t mapped_bytes; /**< mappings of the blocks out of the arena */
+    unsigned long nr_allocs; /**< blocks handed out since pool_init() */
+    unsigned long nr_frees;  /**< blocks given back since pool_init() */
+    double fragmentation;    /**< 1 - largest_free / free_bytes */
+    size_t free_hist[POOL_NR_CLASSES]; /**< free blocks of [2^i, 2^(i+1)) B */
+} pool_stats_t;
+
+/* Usage statistics.
+ * Every figure is maintained as blocks are allocated, released, split and
+ * merged, so a snapshot is taken without walking the free space, cheap
+ * enough to be exported periodically to a monitoring system. Only the blocks
+ * of the largest size class are looked at to find largest_free in
+ * POOL_BINNED mode, while the other modes keep the largest size of every
+ * class as blocks are released. Once the largest block of a class is taken
+ * while others remain, it is an upper bound, exact again when a single
+ * block is left. A fragmentation close to 1 means requests may fail while
+ * plenty of bytes are still free.
+ *   @stats: filled with the current figures
+ */
+void pool_stats(pool_stats_t *stats);
+void pool_stats_ex(pool_t *pool, pool_stats_t *stats);
+
+/* Payload bytes held in the cache of the calling thread, free for it only,
+ * counted as in use by pool_stats(). Read without the lock, cheap enough to
+ * be subtracted from every sample of the arena usage.
+ * Returns:
+ *   the bytes cached, 0 if the pool is not POOL_THREAD_SAFE, is POOL_SHARED,
+ *   or the thread has no cache
+ */
+size_t pool_cache_bytes(void);
+size_t pool_cache_bytes_ex(pool_t *pool);
+
+/* Walks the whole arena to check its consistency: the size and boundary
+ * tags of every block, the free lists and bins against the blocks really
+ * free, and with MPOOL_DEBUG the canaries of the allocated blocks. Meant for
+ * tests and debugging, it takes a time linear in the number of blocks.
+ * Returns:
+ *   true if consistent, otherwise false once the first damage found is
+ *   reported on stderr
+ */
+bool pool_check(void);
+bool pool_check_ex(pool_t *pool);
+
+/* Relocatable blocks.
+ * A block allocated through a handle may be moved by pool_compact(), which
+ * slides such blocks down over the holes in front of them, so the holes
+ * merge together into free space large enough for requests which would fail
+ * otherwise. Its address is only valid from pool_handle_lock() until the
+ * matching pool_handle_unlock(), the block does not move meanwhile. Locks
+ * nest. The other blocks never move, a hole stops at the first one.
+ */
+typedef struct pool_handle pool_handle_t;
+
+/* Allocates a relocatable block of @size bytes, one word more being taken
+ * from the arena.
+ * Returns:
+ *   the handle of the block, unlocked, otherwise NULL if failed
+ */
+pool_handle_t *pool_handle_alloc(size_t size);
+pool_handle_t *pool_handle_alloc_ex(pool_t *pool, size_t size);
+
+/* Pins the block of @handle in place.
+ * Returns:
+ *   the current address of the block, valid until unlocked
+ */
+void *pool_handle_lock(pool_handle_t *handle);
+void *pool_handle_lock_ex(pool_t *pool, pool_handle_t *handle);
+
+void pool_handle_unlock(pool_handle_t *handle);
+void pool_handle_unlock_ex(pool_t *pool, pool_handle_t *handle);
+
+/* Releases the block of @handle, unlocked, and the handle itself.
+ *   @handle: NULL is ignored
+ */
+void pool_handle_free(pool_handle_t *handle);
+void pool_handle_free_ex(pool_t *pool, pool_handle_t *handle);
+
+/* Incremental compaction.
+ * Walks on from where the last call stopped, moving the unlocked blocks of
+ * the handles over the holes before them, until @budget is spent. Meant to
+ * be called from an idle loop, a step lasting as long as it takes to copy
+ * @budget bytes.
+ *   @budget: bytes the step may copy, each block walked over counting for
+ *            a word, the last block moved may overrun it
+ * Returns:
+ *   false once the walk reached the end of the arena, the next call starts
+ *   over, otherwise true
+ */
+bool pool_compact(size_t budget);
+bool pool_compact_ex(pool_t *pool, size_t budget);
+
+/* Fixed-size object slabs.
+ * A slab carves a single chunk of @count objects of @obj_size bytes out of
+ * the arena, then hands objects out and takes them back in constant time
+ * from an intrusive free list, without any per-object header. Meant for the
+ * few sizes allocated over and over, such as list or tree nodes. A slab is
+ * not thread-safe, even if its pool is.
+ */
+typedef struct pool_slab pool_slab_t;
+
+/* Creates a slab in the default pool, or in @pool with the _ex() variant.
+ *   @obj_size: size in byte of an object, rounded up to a pointer size
+ *   @count: number of objects the slab holds
+ * Returns:
+ *   the slab, otherwise NULL if the arena has no room for it
+ */
+pool_slab_t *pool_slab_create(size_t obj_size, int count);
+pool_slab_t *pool_slab_create_ex(pool_t *pool, size_t obj_size, int count);
+
+/* Takes an object from the slab.
+ * Returns:
+ *   the object address, otherwise NULL if all objects are in use
+ */
+void *pool_slab_alloc(pool_slab_t *slab);
+
+/* Gives an object back to the slab it comes from.
+ *   @obj: the object address, NULL is ignored
+ */
+void pool_slab_free(pool_slab_t *slab, void *obj);
+
+/* Releases the slab chunk to its pool, all its objects at once */
+void pool_slab_destroy(pool_slab_t *slab);
+
+/* Bump regions.
+ * A region hands out objects by bumping a pointer through chunks taken from
+ * the arena, and takes them back all at once: there is no per-object header
+ * and no free. Meant for request-scoped allocations, released together when
+ * the request ends. A region is not thread-safe, even if its pool is.
+ */
+typedef struct pool_bump pool_bump_t;
+
+/* Checkpoint of a region, see pool_bump_mark() */
+typedef struct {
+    void *chunk; /**< chunk being filled at the mark */
+    char *top;   /**< first free byte of @chunk at the mark */
+} pool_bump_mark_t;
+
+/* Creates a region in the default pool, or in @pool with the _ex() variant.
+ *   @size: room in byte of a chunk, a chunk is allocated right away and
+ *          larger objects get a chunk of their own
+ * Returns:
+ *   the region, otherwise NULL if the arena has no room for it
+ */
+pool_bump_t *pool_bump_create(size_t size);
+pool_bump_t *pool_bump_create_ex(pool_t *pool, size_t size);
+
+/* Allocates an object from the region, pointer aligned, or aligned on
+ * @alignment, a power of two, with pool_bump_memalign().
+ * Returns:
+ *   the object address, otherwise NULL if the pool is out of memory
+ */
+void *pool_bump_alloc(pool_bump_t *bump, size_t size);
+void *pool_bump_memalign(pool_bump_t *bump, size_t alignment, size_t size);
+
+/* Takes a checkpoint of the region, to release everything allocated past it
+ * with pool_bump_release(). Releasing a mark invalidates the marks taken
+ * after it.
+ */
+pool_bump_mark_t pool_bump_mark(const pool_bump_t *bump);
+void pool_bump_release(pool_bump_t *bump, pool_bump_mark_t mark);
+
+/* Releases all objects of the region at once, in constant time: the chunks
+ * it has grown into are kept, and grown into again before the region takes
+ * new ones from the pool. They are given back by pool_bump_destroy() only,
+ * or by pool_bump_release() once chained again.
+ */
+void pool_bump_reset(pool_bump_t *bump);
+
+/* Releases the region and all its chunks to the pool */
+void pool_bump_destroy(pool_bump_t *bump);
+
+/* NUMA-aware pools.
+ * One pool_map() arena per online node, its pages and its pool_t bound to
+ * the node with mbind(). An allocation is served from the arena of the node
+ * the calling thread runs on, then from the other ones once full, and a
+ * block is always given back to the arena holding its address. The arenas
+ * are POOL_THREAD_SAFE, whatever @flags. The blocks mapped on their own,
+ * once pool_set_mmap_threshold_ex() is given a node, all belong to the
+ * first online node.
+ */
+#define POOL_MAX_NODES 64
+
+typedef struct pool_numa {
+    int nr_nodes;                  /**< highest online node, plus one */
+    pool_t *nodes[POOL_MAX_NODES]; /**< arena per node, NULL if offline */
+} pool_numa_t;
+
+/* Maps an arena of @size bytes on every online node.
+ *   @flags: allocation mode of the arenas, POOL_GROWABLE excepted
+ * Returns:
+ *   false if one of the arenas could not be mapped, otherwise true
+ */
+bool pool_numa_init(pool_numa_t *numa, size_t size, int flags);
+
+/* Same as pool_malloc(), pool_calloc(), pool_realloc() and pool_free(). A
+ * reallocated block stays on the node owning it, unless it may be mapped.
+ */
+void *pool_numa_malloc(pool_numa_t *numa, size_t size);
+void *pool_numa_calloc(pool_numa_t *numa, size_t size);
+void *pool_numa_realloc(pool_numa_t *numa, void *addr, size_t size);
+void pool_numa_free(pool_numa_t *numa, void *addr);
+
+/* Unmaps the arenas of all the nodes */
+void pool_numa_destroy(pool_numa_t *numa);
+
+/* Allocation tracing.
+ * Records every pool_malloc(), pool_calloc(), pool_memalign(),
+ * pool_realloc() and pool_free() call, on any pool, to a compact binary
+ * trace which replay.out can run against the allocator later on. Costs a
+ * single test per call while stopped.
+ *   @path: file receiving the trace, truncated
+ * Returns:
+ *   false if a trace is already recorded or the file can not be created
+ */
+bool pool_trace_start(const char *path);
+
+/* Stops the recording and closes the trace file */
+void pool_trace_stop(void);
+
+/* Allocation profiling.
+ * Samples one allocation in @period, per thread, on any pool, and accounts
+ * it to its site until released: the address the allocation function was
+ * called from, or the tag given to pool_malloc_tagged(). Meant to find out
+ * which call sites own the bytes of a growing service, pool_profile_dump()
+ * prints their estimated live bytes and blocks, the largest first, and
+ * their allocation rate since the start. While stopped, it costs the same
+ * single test per call as the tracing.
+ *   @period: 1 samples every allocation
+ * Returns:
+ *   false if a profile is already taken or @period is 0
+ */
+bool pool_profile_start(unsigned int period);
+
+/* Stops the sampling and forgets the sites */
+void pool_profile_stop(void);
+
+/* Prints the sites sampled so far to @out, one per line, the caller
+ * addresses to resolve with addr2line
+ */
+void pool_profile_dump(FILE *out);
+
+/* Same as pool_malloc(), the block accounted to @tag rather than the caller
+ * address by the profile.
+ *   @tag: a name which outlives the profile, a string literal usually
+ */
+void *pool_malloc_tagged(size_t size, const char *tag);
+void *pool_malloc_tagged_ex(pool_t *pool, size_t size, const char *tag);
+
+/* Shared arena.
+ * Lays out a pool in the @size bytes at @addr, its pool_t included, which
+ * several processes mapping them can use at once: the lock is process-shared,
+ * and the blocks only go through it, the thread caches and the stack of the
+ * frees made without the lock being private to a process. For the same
+ * reason, POOL_GROWABLE, POOL_QUICK, POOL_PACKED and POOL_NEXT_FIT are
+ * refused, and so are the handles; pool_compact() does nothing. A process
+ * dying with the lock held leaves it so.
+ *   @addr: start of the shared mapping, aligned on the pool alignment
+ *   @size: size in byte of the mapping
+ *   @flags: allocation mode, POOL_THREAD_SAFE being implied
+ * Returns:
+ *   the pool, otherwise NULL if @size is too small or @flags not supported
+ */
+pool_t *pool_init_shared(void *addr, size_t size, int flags);
+
+/* Reopens the pool laid out at @addr by pool_init_shared(), in this process
+ * or another one, now or before a restart, without initializing anything.
+ * The caller only unmaps the arena once done, pool_destroy_ex() destroying
+ * the pool for all of them.
+ *   @addr: start of the mapping, the address it was laid out at, or any
+ *          address aligned on the pool alignment with MPOOL_COMPACT
+ * Returns:
+ *   the pool, otherwise NULL if @addr holds none, or one of another build
+ */
+pool_t *pool_attach(void *addr);
+
+/* Releases the lock and the thread caches key of a POOL_THREAD_SAFE pool, no
+ * thread may use it afterwards, unmaps the arena of a pool_map() pool, the
+ * size and block arrays of a POOL_PACKED pool and the tables of the handles,
+ * and gives back the regions chained by a POOL_GROWABLE pool. A POOL_SHARED
+ * pool can not be attached any more.
+ * These side tables are mapped whatever the arena, one given to pool_init()
+ * included: they leak unless the pool is destroyed. Only a pool of none of
+ * these modes, which never allocated a handle, has nothing to release.
+ *   @pool: pool to destroy, its arena can then be reused
+ */
+void pool_destroy_ex(pool_t *pool);
\ No newline at end of file
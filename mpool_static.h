@@ -0,0 +1,121 @@
+/* Fixed configuration allocators, resolved at compile time */
+
+#pragma once
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <string.h>
+
+/* MPOOL_DEFINE(name, arena_size, align, sizes...) instantiates an allocator
+ * of its own, which shares nothing with the pools nor with the other
+ * instances: its arena is a static array of @arena_size bytes, aligned on
+ * @align, and its blocks come in the few @sizes given, in any order.
+ *
+ * Each size is a class with its own free list. A block taken for the first
+ * time is cut from the arena top, a block released is pushed on the list of
+ * its class, linked through its first word, so blocks carry no header:
+ *
+ *   arena: ┌────┬────┬────────┬────┬────────┬─────────────────────┐
+ *          │ 16 │ 16 │   64   │ 16 │   64   │ ~~~ never used ~~~~ │
+ *          └────┴────┴────────┴────┴────────┴─────────────────────┘
+ *   16: ──▶ ▪ ──▶ ▪                         ▲ top
+ *   64: ──▶ ▪
+ *
+ * The functions are static inline ones over constants only, so once
+ * optimized a call with a constant size compiles down to the pop of a given
+ * free list: the class lookup and the rounding are folded away. It
+ * generates, for MPOOL_DEFINE(frames, 1 << 16, 8, 16, 64):
+ *
+ *   void *frames_malloc(size_t size);
+ *   void *frames_calloc(size_t size);
+ *   void frames_free(void *addr, size_t size);
+ *   void frames_reset(void);
+ *
+ * frames_malloc() returns NULL when @size exceeds the largest class or once
+ * the arena is exhausted. frames_free() takes the @size given to
+ * frames_malloc(), or any size of the same class, and ignores NULL as well
+ * as a size no class holds, which no block of the instance can have.
+ * frames_reset() releases all the blocks at once. An instance is not
+ * thread-safe.
+ */
+#define MPOOL_DEFINE(name, arena_size, align, ...)                           \
+    _Static_assert((align) >= sizeof(void *) && !((align) & ((align) - 1)),  \
+                   #name ": the alignment must be a power of two, at least " \
+                         "a pointer");                                       \
+                                                                             \
+    static const size_t name##_sizes[] = {__VA_ARGS__};                      \
+                                                                             \
+    enum {                                                                   \
+        name##_nr_classes = sizeof(name##_sizes) / sizeof(size_t),           \
+    };                                                                       \
+                                                                             \
+    static struct {                                                          \
+        alignas(align) char arena[arena_size];                               \
+        size_t top;                         /**< arena bytes used */         \
+        void *free_list[name##_nr_classes]; /**< blocks released */          \
+    } name##_state;                                                          \
+                                                                             \
+    /* Size of the blocks of class @c, aligned and able to hold a link */    \
+    static inline size_t name##_class_size(int c)                            \
+    {                                                                        \
+        size_t size = name##_sizes[c] < sizeof(void *) ? sizeof(void *)      \
+                                                       : name##_sizes[c];    \
+        return (size + (align) - 1) & ~(size_t) ((align) - 1);               \
+    }                                                                        \
+                                                                             \
+    /* Smallest class holding @size bytes, -1 if none */                     \
+    static inline int name##_class(size_t size)                              \
+    {                                                                        \
+        int best = -1;                                                       \
+        for (int c = 0; c < name##_nr_classes; c++) {                        \
+            if (size <= name##_sizes[c] &&                                   \
+                (best < 0 || name##_sizes[c] < name##_sizes[best]))          \
+                best = c;                                                    \
+        }                                                                    \
+        return best;                                                         \
+    }                                                                        \
+                                                                             \
+    static inline void *name##_malloc(size_t size)                           \
+    {                                                                        \
+        int c = name##_class(size);                                          \
+        if (!size || c < 0)                                                  \
+            return NULL;                                                     \
+                                                                             \
+        void *addr = name##_state.free_list[c];                              \
+        if (addr) {                                                          \
+            name##_state.free_list[c] = *(void **) addr;                     \
+            return addr;                                                     \
+        }                                                                    \
+                                                                             \
+        if (sizeof(name##_state.arena) - name##_state.top <                  \
+            name##_class_size(c))                                            \
+            return NULL;                                                     \
+        addr = name##_state.arena + name##_state.top;                        \
+        name##_state.top += name##_class_size(c);                            \
+        return addr;                                                         \
+    }                                                                        \
+                                                                             \
+    static inline void *name##_calloc(size_t size)                           \
+    {                                                                        \
+        void *addr = name##_malloc(size);                                    \
+        if (addr)                                                            \
+            memset(addr, 0, size);                                           \
+        return addr;                                                         \
+    }                                                                        \
+                                                                             \
+    static inline void name##_free(void *addr, size_t size)                  \
+    {                                                                        \
+        int c = name##_class(size);                                          \
+        if (!addr || c < 0)                                                  \
+            return;                                                          \
+                                                                             \
+        *(void **) addr = name##_state.free_list[c];                         \
+        name##_state.free_list[c] = addr;                                    \
+    }                                                                        \
+                                                                             \
+    static inline void name##_reset(void)                                    \
+    {                                                                        \
+        name##_state.top = 0;                                                \
+        for (int c = 0; c < name##_nr_classes; c++)                          \
+            name##_state.free_list[c] = NULL;                                \
+    }
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mpool.h"
+
+/* One pool per NUMA node, each in its own mapping, bound to the node with
+ * mbind() before the pages are touched, the pool_t included since every
+ * allocation reads and writes its lists:
+ *
+ *   node 0: ┌──────┐  ┌──────────────────────────┐
+ *           │pool_t│─▶│ arena, pages of node 0   │ ◀── threads on node 0
+ *           └──────┘  └──────────────────────────┘
+ *   node 1: ┌──────┐  ┌──────────────────────────┐
+ *           │pool_t│─▶│ arena, pages of node 1   │ ◀── threads on node 1
+ *           └──────┘  └──────────────────────────┘
+ *
+ * A block is given back to the pool whose mapping holds its address, so
+ * the thread releasing it may run on any node. Where mbind() is not
+ * available, the pages land on the node of the thread touching them first,
+ * which is the one allocating from the local arena anyway.
+ *
+ * A block mapped on its own, once a node pool is given a threshold, is in
+ * no arena. Only the first node keeps those, the home node, to which every
+ * address out of the arenas then goes back.
+ */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+/* Prefers @node for the pages of @addr, moving those already touched */
+static void numa_bind(void *addr, size_t len, int node)
+{
+#ifdef SYS_mbind
+    unsigned long mask[POOL_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+
+    mask[node / (8 * sizeof(*mask))] = 1UL << (node % (8 * sizeof(*mask)));
+    /* the kernel expects one more bit than the mask holds */
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, POOL_MAX_NODES + 1,
+            MPOL_MF_MOVE);
+#endif
+}
+
+/* Reads the online nodes, a list of ranges such as "0-1,3".
+ * Returns:
+ *   their bitmap, node 0 alone if unknown
+ */
+static uint64_t numa_online(void)
+{
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (!f)
+        return 1;
+
+    uint64_t online = 0;
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1) {
+        if (fscanf(f, "-%d", &hi) != 1)
+            hi = lo;
+        for (int n = lo; n <= hi && n < POOL_MAX_NODES; n++)
+            online |= (uint64_t) 1 << n;
+        if (fgetc(f) != ',')
+            break;
+    }
+    fclose(f);
+    return online ? online : 1;
+}
+
+/* Length of the mapping holding the pool_t of a node, whole pages */
+static inline size_t node_pool_len(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(pool_t) + page - 1) & ~(page - 1);
+}
+
+static pool_t *node_pool_create(int node, size_t size, int flags)
+{
+    size_t len = node_pool_len();
+    pool_t *pool = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED)
+        return NULL;
+    numa_bind(pool, len, node);
+
+    if (!pool_map_ex(pool, size, flags)) {
+        munmap(pool, len);
+        return NULL;
+    }
+    numa_bind(pool->map_base, pool->map_size, node);
+    return pool;
+}
+
+static void node_pool_destroy(pool_t *pool)
+{
+    pool_destroy_ex(pool);
+    munmap(pool, node_pool_len());
+}
+
+bool pool_numa_init(pool_numa_t *numa, size_t size, int flags)
+{
+    /* the blocks of a region could not be found back by their address */
+    if (flags & POOL_GROWABLE)
+        return false;
+
+    uint64_t online = numa_online();
+    numa->nr_nodes = 0;
+    for (int n = 0; n < POOL_MAX_NODES; n++) {
+        numa->nodes[n] = NULL;
+        if (!(online & ((uint64_t) 1 << n)))
+            continue;
+
+        numa->nodes[n] = node_pool_create(n, size, flags | POOL_THREAD_SAFE);
+        if (!numa->nodes[n]) {
+            pool_numa_destroy(numa);
+            return false;
+        }
+        numa->nr_nodes = n + 1;
+    }
+    return true;
+}
+
+void pool_numa_destroy(pool_numa_t *numa)
+{
+    for (int n = 0; n < numa->nr_nodes; n++) {
+        if (numa->nodes[n])
+            node_pool_destroy(numa->nodes[n]);
+        numa->nodes[n] = NULL;
+    }
+    numa->nr_nodes = 0;
+}
+
+/* Node of the calling thread, whose arena is tried first */
+static inline int numa_local(const pool_numa_t *numa)
+{
+    unsigned int cpu, node;
+
+    if (getcpu(&cpu, &node) || node >= (unsigned int) numa->nr_nodes ||
+        !numa->nodes[node])
+        return 0;
+    return node;
+}
+
+static inline bool numa_holds(const pool_t *pool, const void *addr)
+{
+    return (uintptr_t) addr - (uintptr_t) pool->map_base < pool->map_size;
+}
+
+/* First online node, owning the blocks mapped on their own */
+static inline pool_t *numa_home(const pool_numa_t *numa)
+{
+    for (int n = 0; n < numa->nr_nodes; n++) {
+        if (numa->nodes[n])
+            return numa->nodes[n];
+    }
+    return NULL;
+}
+
+/* Pool owning @addr, the home node if in no arena */
+static pool_t *numa_owner(const pool_numa_t *numa, const void *addr)
+{
+    for (int n = 0; n < numa->nr_nodes; n++) {
+        pool_t *pool = numa->nodes[n];
+        if (pool && numa_holds(pool, addr))
+            return pool;
+    }
+    return numa_home(numa);
+}
+
+static inline void *node_alloc(pool_t *pool, size_t size, bool zero)
+{
+    return zero ? pool_calloc_ex(pool, size) : pool_malloc_ex(pool, size);
+}
+
+/* Allocates from the local arena, then from the other ones once full. A
+ * block another node maps is given back to it, and asked for to the home
+ * node instead.
+ */
+static void *numa_alloc(pool_numa_t *numa, size_t size, bool zero)
+{
+    int local = numa_local(numa);
+    pool_t *home = numa_home(numa);
+
+    for (int i = 0; i < numa->nr_nodes; i++) {
+        pool_t *pool = numa->nodes[(local + i) % numa->nr_nodes];
+        if (!pool)
+            continue;
+
+        void *ptr = node_alloc(pool, size, zero);
+        if (ptr && pool != home && !numa_holds(pool, ptr)) {
+            pool_free_ex(pool, ptr);
+            ptr = node_alloc(home, size, zero);
+        }
+        if (ptr)
+            return ptr;
+    }
+    return NULL;
+}
+
+void *pool_numa_malloc(pool_numa_t *numa, size_t size)
+{
+    return numa_alloc(numa, size, false);
+}
+
+void *pool_numa_calloc(pool_numa_t *numa, size_t size)
+{
+    return numa_alloc(numa, size, true);
+}
+
+void *pool_numa_realloc(pool_numa_t *numa, void *addr, size_t size)
+{
+    pool_t *pool = numa_owner(numa, addr);
+    if (!addr || !pool)
+        return pool_numa_malloc(numa, size);
+
+    /* a block stays on its node, even when the thread runs on another one,
+     * but one the node could map is moved by hand for the home node to own
+     */
+    if (pool == numa_home(numa) || !pool->mmap_threshold || !size)
+        return pool_realloc_ex(pool, addr, size);
+
+    void *ptr = pool_numa_malloc(numa, size);
+    if (ptr) {
+        size_t old = pool_usable_size_ex(pool, addr);
+        memcpy(ptr, addr, old < size ? old : size);
+        pool_free_ex(pool, addr);
+    }
+    return ptr;
+}
+
+void pool_numa_free(pool_numa_t *numa, void *addr)
+{
+    pool_t *pool = numa_owner(numa, addr);
+    if (addr && pool)
+        pool_free_ex(pool, addr);
+}
@@ -0,0 +1,270 @@
+/* Interposition of the C library allocator.
+ *
+ * Built as libmpool.so, this exports malloc(), free(), calloc(), realloc()
+ * and the aligned and introspection variants, all served by a single
+ * POOL_BINNED | POOL_THREAD_SAFE | POOL_GROWABLE pool, so any dynamically
+ * linked binary runs on the allocator unchanged:
+ *
+ *   LD_PRELOAD=./libmpool.so ./service
+ *
+ * As in the C library, the large requests are mapped on their own, so the
+ * regions chained by growth are not kept for the sake of a transient buffer.
+ *
+ * The pool itself calls into the C library, pthread_setspecific() or the
+ * trace stdio may allocate: such calls, made while the thread is already in
+ * the pool, are served from a static bootstrap buffer instead, never given
+ * back, so they can not recurse.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mpool.h"
+
+enum {
+    bootstrap_size = 1 << 16,
+    /* alignment the C library guarantees to malloc() */
+    shim_align = alignof(max_align_t),
+    /* default M_MMAP_THRESHOLD of the C library */
+    shim_mmap_threshold = 128 << 10,
+};
+
+static pool_t pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static bool pool_ready;
+
+/* Set while the thread runs the pool code */
+static __thread bool in_pool __attribute__((tls_model("initial-exec")));
+
+/* Blocks handed out while in the pool, each after a header holding its size:
+ * ┌──────┬─────────┬──────┬─────────┬──────────────────────────┐
+ * │ size │ Block 0 │ size │ Block 1 │ ~~~~~~~~ unused ~~~~~~~~ │
+ * └──────┴─────────┴──────┴─────────┴──────────────────────────┘
+ *                                   ▲ bootstrap_top
+ */
+static alignas(shim_align) char bootstrap[bootstrap_size];
+static size_t bootstrap_top;
+
+static inline bool is_bootstrap(const void *addr)
+{
+    return (uintptr_t) addr - (uintptr_t) bootstrap < bootstrap_size;
+}
+
+static void *bootstrap_alloc(size_t alignment, size_t size)
+{
+    if (alignment < shim_align)
+        alignment = shim_align;
+    if (size > bootstrap_size || alignment > bootstrap_size / 2)
+        return NULL;
+
+    /* room for the header before the aligned address */
+    size_t need = (size + alignment + shim_align - 1) & ~(shim_align - 1);
+    size_t top = __atomic_fetch_add(&bootstrap_top, need, __ATOMIC_RELAXED);
+    if (top > bootstrap_size - need)
+        return NULL;
+
+    uintptr_t addr = (uintptr_t) bootstrap + top + shim_align;
+    addr = (addr + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    ((size_t *) addr)[-1] = size;
+    return (void *) addr;
+}
+
+static inline size_t bootstrap_usable_size(const void *addr)
+{
+    return ((const size_t *) addr)[-1];
+}
+
+/* Holds the pool lock across fork(), the child then gets a pool in a
+ * consistent state, whatever the other threads of the parent were doing.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&pool.lock);
+}
+
+static void fork_done(void)
+{
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_setup(void)
+{
+    int flags = POOL_BINNED | POOL_THREAD_SAFE | POOL_GROWABLE |
+                POOL_ALIGN(shim_align);
+
+    if (!pool_init_ex(&pool, NULL, 0, flags))
+        return;
+    pool_set_mmap_threshold_ex(&pool, shim_mmap_threshold);
+    pthread_atfork(fork_prepare, fork_done, fork_done);
+    pool_ready = true;
+}
+
+/* Enters the pool code.
+ * Returns:
+ *   false if the thread already runs it or the pool could not be set up,
+ *   the bootstrap buffer then serves
+ */
+static inline bool pool_enter(void)
+{
+    if (in_pool)
+        return false;
+
+    in_pool = true;
+    pthread_once(&pool_once, pool_setup);
+    if (!pool_ready)
+        in_pool = false;
+    return pool_ready;
+}
+
+static inline void *pool_leave(void *ptr)
+{
+    in_pool = false;
+    if (!ptr)
+        errno = ENOMEM;
+    return ptr;
+}
+
+void *malloc(size_t size)
+{
+    if (!pool_enter())
+        return bootstrap_alloc(0, size);
+
+    /* a unique address, freed as any other block */
+    return pool_leave(pool_malloc_ex(&pool, size ? size : 1));
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t total = n * size;
+
+    /* the bootstrap buffer is never reused, so reads as zero */
+    if (!pool_enter())
+        return bootstrap_alloc(0, total);
+    return pool_leave(pool_calloc_ex(&pool, total ? total : 1));
+}
+
+void free(void *addr)
+{
+    if (!addr || is_bootstrap(addr))
+        return;
+
+    bool nested = in_pool;
+    in_pool = true;
+    pool_free_ex(&pool, addr);
+    in_pool = nested;
+}
+
+void *realloc(void *addr, size_t size)
+{
+    if (!addr)
+        return malloc(size);
+    if (!size) {
+        free(addr);
+        return NULL;
+    }
+
+    if (is_bootstrap(addr)) {
+        size_t old = bootstrap_usable_size(addr);
+        void *ptr = malloc(size);
+        if (ptr)
+            memcpy(ptr, addr, old < size ? old : size);
+        return ptr;
+    }
+
+    /* Called from the pool, which may hold its lock: the block moves to the
+     * bootstrap buffer, the old one released as free() does, without it.
+     */
+    if (in_pool) {
+        size_t old = pool_usable_size_ex(&pool, addr);
+        void *ptr = bootstrap_alloc(0, size);
+        if (ptr) {
+            memcpy(ptr, addr, old < size ? old : size);
+            free(addr);
+        }
+        return ptr;
+    }
+
+    in_pool = true;
+    return pool_leave(pool_realloc_ex(&pool, addr, size));
+}
+
+void *reallocarray(void *addr, size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(addr, n * size);
+}
+
+/* Common to the aligned variants, @alignment being a power of two */
+static void *shim_memalign(size_t alignment, size_t size)
+{
+    if (!pool_enter())
+        return bootstrap_alloc(alignment, size);
+
+    size = size ? size : 1;
+    if (alignment <= shim_align)
+        return pool_leave(pool_malloc_ex(&pool, size));
+    return pool_leave(pool_memalign_ex(&pool, alignment, size));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment & (alignment - 1) || alignment % sizeof(void *))
+        return EINVAL;
+
+    int saved = errno;
+    void *ptr = shim_memalign(alignment, size);
+    errno = saved;
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!alignment || alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return shim_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return shim_memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return shim_memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *addr)
+{
+    if (is_bootstrap(addr))
+        return bootstrap_usable_size(addr);
+    return pool_usable_size_ex(&pool, addr);
+}
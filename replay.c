@@ -0,0 +1,295 @@
+/* Replays an allocation trace recorded with pool_trace_start().
+ *
+ * The trace is loaded in memory first, then run against a fresh pool in each
+ * allocation mode and placement policy, so that they are compared on the very
+ * same workload. Every run reports the replay time, the peak usage of the
+ * arena, the allocations which failed and the fragmentation left once the
+ * trace ends.
+ *
+ * Usage: replay.out [-s arena_size] trace
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpool.h"
+#include "trace.h"
+
+struct record {
+    uint8_t op;
+    size_t align, size;
+    uint32_t old, id;
+};
+
+struct trace {
+    struct record *records;
+    long count;
+    uint32_t max_id;
+    uint64_t duration_ns; /**< time span of the recording */
+};
+
+static int get_varint(FILE *f, uint64_t *v)
+{
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = getc(f)) == EOF || shift > 63)
+            return -1;
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+static int trace_load(const char *path, struct trace *t)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    uint32_t magic;
+    if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s: not an allocation trace\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    long capacity = 0;
+    int op;
+    while ((op = getc(f)) != EOF) {
+        struct record r = {.op = op};
+        uint64_t delta, v[3] = {0};
+        int nr_fields = 3;
+
+        if (op == TRACE_FREE)
+            nr_fields = 1;
+        else if (op == TRACE_MALLOC || op == TRACE_CALLOC)
+            nr_fields = 2;
+
+        if (op < TRACE_MALLOC || op > TRACE_FREE || get_varint(f, &delta))
+            goto corrupted;
+        for (int i = 0; i < nr_fields; i++) {
+            if (get_varint(f, &v[i]))
+                goto corrupted;
+        }
+
+        switch (op) {
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+            r.size = v[0];
+            r.id = v[1];
+            break;
+        case TRACE_MEMALIGN:
+            r.align = v[0];
+            r.size = v[1];
+            r.id = v[2];
+            break;
+        case TRACE_REALLOC:
+            r.old = v[0];
+            r.size = v[1];
+            r.id = v[2];
+            break;
+        case TRACE_FREE:
+            r.old = v[0];
+            break;
+        }
+
+        if (t->count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            t->records = realloc(t->records, capacity * sizeof(*t->records));
+            if (!t->records) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        t->records[t->count++] = r;
+        t->duration_ns += delta;
+        if (r.id > t->max_id)
+            t->max_id = r.id;
+    }
+    fclose(f);
+    return 0;
+
+corrupted:
+    fprintf(stderr, "%s: truncated or corrupted record %ld\n", path,
+            t->count);
+    fclose(f);
+    return -1;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Largest block the pool can still allocate, found by bisection, up to the
+ * @free_bytes it has
+ */
+static size_t largest_block(pool_t *pool, size_t free_bytes)
+{
+    size_t lo = 0, hi = free_bytes;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        void *ptr = pool_malloc_ex(pool, mid);
+        if (ptr) {
+            pool_free_ex(pool, ptr);
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/* Run of a trace against one pool */
+struct run {
+    const struct trace *t;
+    pool_t *pool;
+    void **blocks;
+    long failures;
+    size_t peak;      /**< arena usage, the thread cache aside */
+    uint64_t elapsed; /**< replay time */
+};
+
+/* Replays the trace in a thread of its own, whose cache the pool gets back
+ * once it exits, before the free space is measured
+ */
+static void *replay_run(void *arg)
+{
+    struct run *run = arg;
+    const struct trace *t = run->t;
+    pool_t *pool = run->pool;
+    void **blocks = run->blocks;
+    uint64_t start = now_ns();
+
+    for (long i = 0; i < t->count; i++) {
+        const struct record *r = &t->records[i];
+        void *ptr;
+
+        /* failed while recording, nothing to replay */
+        if (r->op != TRACE_FREE && !r->id)
+            continue;
+
+        switch (r->op) {
+        case TRACE_MALLOC:
+            ptr = pool_malloc_ex(pool, r->size);
+            break;
+        case TRACE_CALLOC:
+            ptr = pool_calloc_ex(pool, r->size);
+            break;
+        case TRACE_MEMALIGN:
+            ptr = pool_memalign_ex(pool, r->align, r->size);
+            break;
+        case TRACE_REALLOC:
+            ptr = pool_realloc_ex(pool, blocks[r->old], r->size);
+            if (ptr)
+                blocks[r->old] = NULL;
+            break;
+        default:
+            pool_free_ex(pool, blocks[r->old]);
+            blocks[r->old] = NULL;
+            continue;
+        }
+
+        if (!ptr)
+            run->failures++;
+        blocks[r->id] = ptr;
+
+        /* the cached blocks are free, only looked up for a new peak */
+        size_t used = pool->size - pool->free_space;
+        if (used > run->peak) {
+            used -= pool_cache_bytes_ex(pool);
+            if (used > run->peak)
+                run->peak = used;
+        }
+    }
+
+    run->elapsed = now_ns() - start;
+    return NULL;
+}
+
+static void replay(const struct trace *t,
+                   const char *name,
+                   int flags,
+                   size_t arena_size)
+{
+    void *arena = malloc(arena_size);
+    void **blocks = calloc(t->max_id + 1, sizeof(*blocks));
+    pool_t pool;
+
+    if (!arena || !blocks || !pool_init_ex(&pool, arena, arena_size, flags)) {
+        fprintf(stderr, "%s: can not set up the arena\n", name);
+        exit(1);
+    }
+
+    struct run run = {.t = t, .pool = &pool, .blocks = blocks};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replay_run, &run) ||
+        pthread_join(thread, NULL)) {
+        fprintf(stderr, "%s: can not run the replay\n", name);
+        exit(1);
+    }
+
+    /* read first, the bisection releases its blocks without the lock */
+    size_t free_bytes = pool.free_space;
+    size_t largest = largest_block(&pool, free_bytes);
+    printf("%-12s %8.1f ms %6.1f ns/op  peak %zu/%zu bytes (%.1f%%)  "
+           "%ld failed  fragmentation %.1f%%\n",
+           name, run.elapsed / 1e6,
+           t->count ? (double) run.elapsed / t->count : 0.0, run.peak,
+           pool.size, 100.0 * run.peak / pool.size, run.failures,
+           free_bytes ? 100.0 * (1 - (double) largest / free_bytes)
+                      : 0.0);
+
+    pool_destroy_ex(&pool);
+    free(blocks);
+    free(arena);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t arena_size = 64 << 20;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            arena_size = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1 || !arena_size)
+        goto usage;
+
+    struct trace t = {0};
+    if (trace_load(argv[optind], &t))
+        return 1;
+    printf("%ld records, %u blocks, recorded over %.1f ms\n", t.count,
+           t.max_id, t.duration_ns / 1e6);
+
+    replay(&t, "first-fit", POOL_FIRST_FIT, arena_size);
+    replay(&t, "next-fit", POOL_NEXT_FIT, arena_size);
+    replay(&t, "best-fit", POOL_BEST_FIT, arena_size);
+    replay(&t, "good-fit", POOL_GOOD_FIT, arena_size);
+    replay(&t, "binned", POOL_BINNED, arena_size);
+    replay(&t, "binned-best", POOL_BINNED | POOL_BEST_FIT, arena_size);
+    replay(&t, "quick", POOL_BINNED | POOL_QUICK, arena_size);
+    replay(&t, "thread-safe", POOL_BINNED | POOL_THREAD_SAFE, arena_size);
+    free(t.records);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-s arena_size] trace\n", argv[0]);
+    return 1;
+}
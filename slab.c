@@ -0,0 +1,117 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mpool.h"
+
+/* A slab is a single chunk of the arena: this header, then @count objects of
+ * @obj_size bytes. A free object stores the address of the next free one in
+ * its first word, so objects carry no header at all:
+ *
+ * ┌──────┬───────┬───────┬───────┬───────┬─────────────────────┐
+ * │ slab │ Obj 0 │ Free ─┼─▶Free │ Obj 3 │ ~~~ never used ~~~~ │
+ * └──────┴───────┴───────┴───────┴───────┴─────────────────────┘
+ *                                        ▲ unused
+ *
+ * Objects never handed out are not linked at creation time, they are taken
+ * one after the other from @unused once the free list is empty.
+ */
+struct pool_slab {
+    pool_t *pool;    /**< pool owning the chunk, NULL for the default one */
+    void *free_list; /**< released objects, NULL terminated */
+    char *unused;    /**< first object never handed out */
+    char *end;       /**< end of the last object */
+    size_t obj_size; /**< size of an object, a multiple of a pointer */
+};
+
+enum {
+    slab_header = (sizeof(pool_slab_t) + sizeof(void *) - 1) &
+                  ~(sizeof(void *) - 1),
+};
+
+/* Rounds @obj_size up to hold the free list link, pointer aligned.
+ * Returns:
+ *   the size of the chunk to allocate, otherwise 0 if it overflows
+ */
+static size_t slab_chunk_size(size_t *obj_size, int count)
+{
+    if (!*obj_size || *obj_size > SIZE_MAX / 2 || count <= 0)
+        return 0;
+
+    if (*obj_size < sizeof(void *))
+        *obj_size = sizeof(void *);
+    *obj_size = (*obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if ((size_t) count > (SIZE_MAX - slab_header) / *obj_size)
+        return 0;
+    return slab_header + *obj_size * count;
+}
+
+static pool_slab_t *slab_setup(pool_slab_t *slab,
+                               pool_t *pool,
+                               size_t obj_size,
+                               int count)
+{
+    if (!slab)
+        return NULL;
+
+    slab->pool = pool;
+    slab->free_list = NULL;
+    slab->unused = (char *) slab + slab_header;
+    slab->end = slab->unused + obj_size * count;
+    slab->obj_size = obj_size;
+    return slab;
+}
+
+pool_slab_t *pool_slab_create_ex(pool_t *pool, size_t obj_size, int count)
+{
+    size_t size = slab_chunk_size(&obj_size, count);
+    if (!size)
+        return NULL;
+
+    return slab_setup(pool_malloc_ex(pool, size), pool, obj_size, count);
+}
+
+pool_slab_t *pool_slab_create(size_t obj_size, int count)
+{
+    size_t size = slab_chunk_size(&obj_size, count);
+    if (!size)
+        return NULL;
+
+    return slab_setup(pool_malloc(size), NULL, obj_size, count);
+}
+
+void *pool_slab_alloc(pool_slab_t *slab)
+{
+    void *obj = slab->free_list;
+    if (obj) {
+        slab->free_list = *(void **) obj;
+        return obj;
+    }
+
+    if (slab->unused == slab->end)
+        return NULL;
+
+    obj = slab->unused;
+    slab->unused += slab->obj_size;
+    return obj;
+}
+
+void pool_slab_free(pool_slab_t *slab, void *obj)
+{
+    if (!obj)
+        return;
+
+    *(void **) obj = slab->free_list;
+    slab->free_list = obj;
+}
+
+void pool_slab_destroy(pool_slab_t *slab)
+{
+    if (!slab)
+        return;
+
+    if (slab->pool)
+        pool_free_ex(slab->pool, slab);
+    else
+        pool_free(slab);
+}
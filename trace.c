@@ -0,0 +1,510 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mpool.h"
+#include "trace.h"
+
+/* Recording side of the allocation traces, see trace.h for the format, and
+ * allocation profiles.
+ *
+ * Addresses are translated to ids with an open addressing hash table of the
+ * live blocks, sized with the C library so that tracing never disturbs the
+ * arenas under study. The profiles keep the sampled blocks in such a table
+ * too.
+ */
+int pool_tracing;
+
+struct trace_slot {
+    const void *ptr; /**< NULL for an empty slot */
+    uint32_t id;     /**< trace id, or profile site */
+    size_t size;     /**< size requested, profiles only */
+};
+
+struct slot_table {
+    struct trace_slot *slots;
+    size_t nr_slots, nr_used; /**< nr_slots is a power of two */
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static uint64_t trace_last_ns;
+static uint32_t trace_next_id;
+static struct slot_table trace_ids;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline size_t ptr_hash(const void *ptr)
+{
+    return ((uintptr_t) ptr >> 3) * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline size_t slot_hash(const struct slot_table *t, const void *ptr)
+{
+    return ptr_hash(ptr) & (t->nr_slots - 1);
+}
+
+static bool slots_insert(struct slot_table *t,
+                         const void *ptr,
+                         uint32_t id,
+                         size_t size);
+
+static bool slots_grow(struct slot_table *t)
+{
+    struct slot_table old = *t;
+
+    t->nr_slots = old.nr_slots ? old.nr_slots * 2 : 1024;
+    t->slots = calloc(t->nr_slots, sizeof(*t->slots));
+    if (!t->slots) {
+        *t = old;
+        return false;
+    }
+
+    t->nr_used = 0;
+    for (size_t i = 0; i < old.nr_slots; i++) {
+        struct trace_slot *s = &old.slots[i];
+        if (s->ptr)
+            slots_insert(t, s->ptr, s->id, s->size);
+    }
+    free(old.slots);
+    return true;
+}
+
+static bool slots_insert(struct slot_table *t,
+                         const void *ptr,
+                         uint32_t id,
+                         size_t size)
+{
+    if (2 * (t->nr_used + 1) > t->nr_slots && !slots_grow(t))
+        return false;
+
+    size_t i = slot_hash(t, ptr);
+    while (t->slots[i].ptr && t->slots[i].ptr != ptr)
+        i = (i + 1) & (t->nr_slots - 1);
+    if (!t->slots[i].ptr)
+        t->nr_used++;
+    t->slots[i] = (struct trace_slot){.ptr = ptr, .id = id, .size = size};
+    return true;
+}
+
+static uint32_t slots_find(const struct slot_table *t, const void *ptr)
+{
+    if (!ptr || !t->nr_slots)
+        return 0;
+
+    size_t i = slot_hash(t, ptr);
+    while (t->slots[i].ptr && t->slots[i].ptr != ptr)
+        i = (i + 1) & (t->nr_slots - 1);
+    return t->slots[i].ptr ? t->slots[i].id : 0;
+}
+
+/* Removes @ptr from the table, shifting back the entries of its cluster.
+ *   @removed: if not NULL, receives the entry
+ * Returns:
+ *   its id, otherwise 0 if it is not a live block
+ */
+static uint32_t slots_remove(struct slot_table *t,
+                             const void *ptr,
+                             struct trace_slot *removed)
+{
+    if (!ptr || !t->nr_slots)
+        return 0;
+
+    size_t mask = t->nr_slots - 1;
+    size_t i = slot_hash(t, ptr);
+    while (t->slots[i].ptr != ptr) {
+        if (!t->slots[i].ptr)
+            return 0;
+        i = (i + 1) & mask;
+    }
+
+    if (removed)
+        *removed = t->slots[i];
+    uint32_t id = t->slots[i].id;
+    size_t hole = i;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (!t->slots[i].ptr)
+            break;
+        /* an entry can fill the hole if its home is not in (hole, i] */
+        size_t home = slot_hash(t, t->slots[i].ptr);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].ptr = NULL;
+    t->nr_used--;
+    return id;
+}
+
+static void slots_clear(struct slot_table *t)
+{
+    free(t->slots);
+    *t = (struct slot_table){0};
+}
+
+static void put_varint(uint64_t v)
+{
+    while (v >= 0x80) {
+        putc_unlocked((v & 0x7f) | 0x80, trace_file);
+        v >>= 7;
+    }
+    putc_unlocked(v, trace_file);
+}
+
+/* Id given to a new block, 0 for NULL */
+static uint32_t trace_new_id(const void *ptr)
+{
+    if (!ptr)
+        return 0;
+
+    uint32_t id = trace_next_id++;
+    slots_insert(&trace_ids, ptr, id, 0);
+    return id;
+}
+
+/* Allocation profiles. One allocation in profile_period is sampled by each
+ * thread, and kept in profile_blocks along with its site until released:
+ *
+ *   site ──▶ sites[i]: allocations, live blocks and bytes     sampled only
+ *                 ▲
+ *   block ──▶ { ptr, i, size }  in profile_blocks
+ *
+ * A release only takes the lock when the filter counts sampled blocks at the
+ * hash of its address, most of them are not sampled at all. The figures are
+ * scaled back by the period when dumped.
+ */
+enum {
+    profile_filter_size = 1 << 12,
+};
+
+struct profile_site {
+    const void *site;   /**< caller address, or tag */
+    bool tagged;        /**< @site is a tag name */
+    uint64_t nr_allocs; /**< allocations sampled */
+    size_t live_blocks; /**< of them not released yet */
+    size_t live_bytes;  /**< their bytes */
+};
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int profile_period; /**< 0 while stopped */
+static uint64_t profile_start_ns;
+static struct slot_table profile_blocks;
+static struct profile_site *sites;
+static uint32_t nr_sites, sites_capacity;
+/* Site indexes plus one, 0 for an empty slot, nr_site_slots a power of two */
+static uint32_t *site_slots;
+static size_t nr_site_slots;
+static uint32_t profile_filter[profile_filter_size];
+static __thread unsigned int profile_countdown;
+static __thread uint32_t profile_seed;
+
+static inline uint32_t *filter_of(const void *ptr)
+{
+    return &profile_filter[(ptr_hash(ptr) >> 20) & (profile_filter_size - 1)];
+}
+
+static bool site_slots_grow(void)
+{
+    size_t nr = nr_site_slots ? 2 * nr_site_slots : 256;
+    uint32_t *slots = calloc(nr, sizeof(*slots));
+    if (!slots)
+        return false;
+
+    for (uint32_t s = 0; s < nr_sites; s++) {
+        size_t i = ptr_hash(sites[s].site) & (nr - 1);
+        while (slots[i])
+            i = (i + 1) & (nr - 1);
+        slots[i] = s + 1;
+    }
+    free(site_slots);
+    site_slots = slots;
+    nr_site_slots = nr;
+    return true;
+}
+
+/* Index of the site @site in sites[], added if new.
+ * Returns:
+ *   the index, otherwise UINT32_MAX if out of memory
+ */
+static uint32_t site_get(const void *site, bool tagged)
+{
+    if (2 * (nr_sites + 1) > nr_site_slots && !site_slots_grow())
+        return UINT32_MAX;
+
+    size_t i = ptr_hash(site) & (nr_site_slots - 1);
+    for (; site_slots[i]; i = (i + 1) & (nr_site_slots - 1)) {
+        struct profile_site *s = &sites[site_slots[i] - 1];
+        if (s->site == site && s->tagged == tagged)
+            return site_slots[i] - 1;
+    }
+
+    if (nr_sites == sites_capacity) {
+        uint32_t capacity = sites_capacity ? 2 * sites_capacity : 64;
+        struct profile_site *grown =
+            realloc(sites, capacity * sizeof(*sites));
+        if (!grown)
+            return UINT32_MAX;
+        sites = grown;
+        sites_capacity = capacity;
+    }
+    sites[nr_sites] = (struct profile_site){.site = site, .tagged = tagged};
+    site_slots[i] = nr_sites + 1;
+    return nr_sites++;
+}
+
+/* Accounts a sampled block to its site, lock held */
+static void profile_insert(const void *ptr,
+                           size_t size,
+                           uint32_t s,
+                           bool allocated)
+{
+    if (s == UINT32_MAX || !slots_insert(&profile_blocks, ptr, s, size))
+        return;
+
+    __atomic_fetch_add(filter_of(ptr), 1, __ATOMIC_RELAXED);
+    sites[s].nr_allocs += allocated;
+    sites[s].live_blocks++;
+    sites[s].live_bytes += size;
+}
+
+/* Forgets a sampled block, lock held.
+ * Returns:
+ *   its site, otherwise UINT32_MAX if @ptr was not sampled
+ */
+static uint32_t profile_remove(const void *ptr)
+{
+    struct trace_slot slot = {0};
+
+    slots_remove(&profile_blocks, ptr, &slot);
+    if (!slot.ptr)
+        return UINT32_MAX;
+    __atomic_fetch_sub(filter_of(ptr), 1, __ATOMIC_RELAXED);
+    sites[slot.id].live_blocks--;
+    sites[slot.id].live_bytes -= slot.size;
+    return slot.id;
+}
+
+/* Allocations to skip before the next sample, drawn at random around the
+ * period, so that a regular pattern of the program is not sampled at the
+ * same point each time.
+ */
+static inline unsigned int profile_skip(unsigned int period)
+{
+    uint32_t x = profile_seed ? profile_seed : (uint32_t) now_ns() | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    profile_seed = x;
+    return x % (2 * (uint64_t) period - 1);
+}
+
+static void profile_record(int op,
+                           size_t size,
+                           const void *old,
+                           const void *ptr,
+                           const void *site)
+{
+    bool tagged = op & TRACE_TAGGED;
+    op &= ~TRACE_TAGGED;
+
+    /* a block sampled and reallocated stays sampled under its first site */
+    bool released = op == TRACE_FREE || (op == TRACE_REALLOC && ptr);
+    if (released && old &&
+        __atomic_load_n(filter_of(old), __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&profile_lock);
+        uint32_t s = profile_period ? profile_remove(old) : UINT32_MAX;
+        if (op == TRACE_REALLOC && s != UINT32_MAX)
+            profile_insert(ptr, size, s, false);
+        pthread_mutex_unlock(&profile_lock);
+        return;
+    }
+    if (!ptr || (op == TRACE_REALLOC && old))
+        return;
+
+    if (profile_countdown) {
+        profile_countdown--;
+        return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    if (profile_period) {
+        profile_countdown = profile_skip(profile_period);
+        profile_insert(ptr, size, site_get(site, tagged), true);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+bool pool_profile_start(unsigned int period)
+{
+    if (!period)
+        return false;
+
+    pthread_mutex_lock(&profile_lock);
+    if (profile_period) {
+        pthread_mutex_unlock(&profile_lock);
+        return false;
+    }
+    profile_period = period;
+    profile_start_ns = now_ns();
+    __atomic_fetch_or(&pool_tracing, TRACE_PROFILING, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profile_lock);
+    return true;
+}
+
+void pool_profile_stop(void)
+{
+    pthread_mutex_lock(&profile_lock);
+    __atomic_fetch_and(&pool_tracing, ~TRACE_PROFILING, __ATOMIC_RELAXED);
+    profile_period = 0;
+    slots_clear(&profile_blocks);
+    free(sites);
+    free(site_slots);
+    sites = NULL;
+    site_slots = NULL;
+    nr_sites = sites_capacity = 0;
+    nr_site_slots = 0;
+    for (int i = 0; i < profile_filter_size; i++)
+        __atomic_store_n(&profile_filter[i], 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+    const struct profile_site *x = a, *y = b;
+    return (x->live_bytes < y->live_bytes) - (x->live_bytes > y->live_bytes);
+}
+
+/* The sites are copied, then printed out of the lock: stdio may allocate, and
+ * the allocation be sampled.
+ */
+void pool_profile_dump(FILE *out)
+{
+    struct profile_site *copy = NULL;
+    uint32_t n = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&profile_lock);
+        if (nr_sites <= n)
+            break;
+        n = nr_sites;
+        pthread_mutex_unlock(&profile_lock);
+        free(copy);
+        if (!(copy = malloc(n * sizeof(*copy))))
+            return;
+    }
+    n = nr_sites;
+    if (n)
+        memcpy(copy, sites, n * sizeof(*copy));
+    size_t period = profile_period;
+    double elapsed = (now_ns() - profile_start_ns) / 1e9;
+    pthread_mutex_unlock(&profile_lock);
+
+    if (n)
+        qsort(copy, n, sizeof(*copy), site_cmp);
+    fprintf(out, "%14s %12s %12s  site, 1 in %zu sampled\n", "live bytes",
+            "live blocks", "allocs/s", period);
+    for (uint32_t s = 0; s < n; s++) {
+        const struct profile_site *site = &copy[s];
+        fprintf(out, "%14zu %12zu %12.0f  ", site->live_bytes * period,
+                site->live_blocks * period,
+                elapsed > 0 ? site->nr_allocs * period / elapsed : 0.0);
+        if (site->tagged)
+            fprintf(out, "%s\n", (const char *) site->site);
+        else
+            fprintf(out, "%p\n", site->site);
+    }
+    free(copy);
+}
+
+void trace_record(int op,
+                  size_t align,
+                  size_t size,
+                  const void *old,
+                  const void *ptr,
+                  const void *site)
+{
+    int hooks = __atomic_load_n(&pool_tracing, __ATOMIC_RELAXED);
+    if (hooks & TRACE_PROFILING)
+        profile_record(op, size, old, ptr, site);
+    if (!(hooks & TRACE_RECORDING))
+        return;
+
+    op &= ~TRACE_TAGGED;
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_file) { /* stopped in between */
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    uint64_t now = now_ns();
+    putc_unlocked(op, trace_file);
+    put_varint(now - trace_last_ns);
+    trace_last_ns = now;
+
+    switch (op) {
+    case TRACE_MEMALIGN:
+        put_varint(align);
+        /* fall through */
+    case TRACE_MALLOC:
+    case TRACE_CALLOC:
+        put_varint(size);
+        put_varint(trace_new_id(ptr));
+        break;
+    case TRACE_REALLOC: {
+        /* a failed realloc() keeps the old block alive */
+        uint32_t old_id = ptr ? slots_remove(&trace_ids, old, NULL)
+                              : slots_find(&trace_ids, old);
+        put_varint(old_id);
+        put_varint(size);
+        put_varint(trace_new_id(ptr));
+        break;
+    }
+    case TRACE_FREE:
+        put_varint(slots_remove(&trace_ids, old, NULL));
+        break;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+bool pool_trace_start(const char *path)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        pthread_mutex_unlock(&trace_lock);
+        return false;
+    }
+
+    trace_file = fopen(path, "wb");
+    if (!trace_file) {
+        pthread_mutex_unlock(&trace_lock);
+        return false;
+    }
+
+    uint32_t magic = TRACE_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, trace_file);
+    trace_last_ns = now_ns();
+    trace_next_id = 1;
+    __atomic_fetch_or(&pool_tracing, TRACE_RECORDING, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    return true;
+}
+
+void pool_trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    __atomic_fetch_and(&pool_tracing, ~TRACE_RECORDING, __ATOMIC_RELAXED);
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    slots_clear(&trace_ids);
+    pthread_mutex_unlock(&trace_lock);
+}
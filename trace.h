@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocation trace format, shared by the recording layer and the replay
+ * driver.
+ *
+ * A trace is a magic word followed by records, each made of a one byte
+ * operation, then unsigned LEB128 integers: the nanoseconds elapsed since the
+ * previous record, then the operation fields.
+ *
+ *   TRACE_MALLOC, TRACE_CALLOC:  size, id
+ *   TRACE_MEMALIGN:              alignment, size, id
+ *   TRACE_REALLOC:               old id, size, id
+ *   TRACE_FREE:                  id
+ *
+ * Blocks are named by ids given in allocation order, starting at 1; id 0
+ * stands for NULL, either a failed allocation or a NULL address.
+ */
+#define TRACE_MAGIC 0x5254504dU /* "MPTR" */
+
+enum trace_op {
+    TRACE_MALLOC = 1,
+    TRACE_CALLOC,
+    TRACE_MEMALIGN,
+    TRACE_REALLOC,
+    TRACE_FREE,
+};
+
+/* ORed with the operation when the site is a tag, not a caller address */
+#define TRACE_TAGGED 0x80
+
+/* What pool_tracing enables */
+enum {
+    TRACE_RECORDING = 1 << 0, /**< a trace is recorded */
+    TRACE_PROFILING = 1 << 1, /**< the allocations are sampled by site */
+};
+
+/* Set while a trace is recorded or a profile taken, tested before any call
+ * to trace_record()
+ */
+extern int pool_tracing;
+
+/* Appends a record to the trace, and samples the call for the profile.
+ *   @op: the operation, with TRACE_TAGGED
+ *   @align: the alignment for TRACE_MEMALIGN, ignored otherwise
+ *   @size: the requested size, ignored for TRACE_FREE
+ *   @old: the address released or reallocated, NULL if none
+ *   @ptr: the address returned, NULL if none
+ *   @site: where the allocation comes from, the caller address or a tag
+ */
+void trace_record(int op,
+                  size_t align,
+                  size_t size,
+                  const void *old,
+                  const void *ptr,
+                  const void *site);
+
+#define TRACE(op, align, size, old, ptr, site)                      \
+    do {                                                            \
+        if (__builtin_expect(                                       \
+                __atomic_load_n(&pool_tracing, __ATOMIC_RELAXED), 0)) \
+            trace_record(op, align, size, old, ptr, site);          \
+    } while (0)
+
+/* Site of a call to a public function, evaluated in its body */
+#define TRACE_CALLER __builtin_return_address(0)